@@ -6,10 +6,12 @@
 #define BLOCKS              64
 #define BLOCK_SIZE          16
 #define SECTORS             16
+#define SECTOR_BLOCKS       4
 #define ACCESS_BYTES        4
 #define KEYS                24
 
 #define CLONE   0
+#define LIBNFC  1
 
 #define READ    0
 #define WRITE   1
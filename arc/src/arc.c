@@ -50,19 +50,16 @@ int turn_rf_off (uint8_t *data, uint8_t size) {
     pmu_wait_ms(5);
 
     /* turning field off */
-    data[0] = PN532_CMD_RFConfiguration;
-    data[1] = 0x01;	/* CfgItem = 0x01 */
-    data[2] = 0x00;	/* RF Field = off */
-    return rfid_execute(&data[0], 3, size);
+    return rfid_execute_frame(rfid_frame_rf_field_off,
+                              sizeof(rfid_frame_rf_field_off), data, size);
 }
 
 int mifare_reader_init(uint8_t *data, uint8_t size)
 {
 
-	/* User Manual S.97 141520.pdf */
-	data[0] = PN532_CMD_SAMConfiguration; /* 0x14 */
-	data[1] = 0x01;		/* Normal Mode */
-	return rfid_execute(&data[0], 2, size);
+	/* User Manual S.97 141520.pdf - SAMConfiguration Normal Mode */
+	return rfid_execute_frame(rfid_frame_sam_configuration,
+				  sizeof(rfid_frame_sam_configuration), data, size);
 }
 
 void dump_mifare_card (void)
@@ -75,10 +72,10 @@ void dump_mifare_card (void)
 
 int initiator_init(uint8_t *data, uint8_t size)
 {
-    data[0] = PN532_CMD_InListPassiveTarget; /* 0x4a */
-    data[1] = 0x01;	/* MaxTg - maximum cards */
-    data[2] = 0x00;	/* BrTy - 106 kbps type A */
-    return rfid_execute(&data[0], 3, size);
+    /* InListPassiveTarget, one card, 106 kbps type A */
+    return rfid_execute_frame(rfid_frame_in_list_passive_target,
+                              sizeof(rfid_frame_in_list_passive_target),
+                              data, size);
 }
 
 int mifare_authenticate_block(uint8_t *data, uint8_t size, uint8_t block)
@@ -128,16 +125,101 @@ int mifare_write_block(uint8_t *data, uint8_t size, uint8_t block)
 }
 
 
+static int sector_res[1 + SECTOR_BLOCKS];
+static uint8_t sector_data[SECTOR_BLOCKS][24];
+static uint8_t sector_count;
+
+static void sector_done(int res, void *data, void *context)
+{
+    (void)data;
+    *((int *) context) = res;
+}
+
+/* queue block reads only once the card accepted the key - reads on
+   an unauthenticated card would each wait out PN532_TIMEOUT_US */
+static void sector_auth_done(int res, void *data, void *context)
+{
+    uint8_t *p = data;
+    uint8_t i;
+    int err;
+
+    sector_done(res, data, context);
+    if (res < 2 || 0x41 != p[0] || 0x00 != p[1])
+        return;
+
+    for (i = 0; i < sector_count; i++)
+        if ((err = rfid_submit(sector_data[i], 4, sizeof(sector_data[i]),
+                               PN532_TIMEOUT_US, sector_done,
+                               &sector_res[i + 1])) < 0) {
+            /* queue full - caller continues with this block */
+            sector_res[i + 1] = err;
+            break;
+        }
+}
+
+/* authenticate, then read the remaining blocks of the sector back-to-back */
+int mifare_read_sector(uint8_t *data, uint8_t size, uint8_t block, uint8_t count)
+{
+    uint8_t i;
+    int res;
+
+    sector_count = count;
+    for (i = 0; i < count; i++) {
+        sector_res[i + 1] = -1;
+        sector_data[i][0] = PN532_CMD_InDataExchange; /* 0x40 */
+        sector_data[i][1] = 0x01;	    /* card 1 */
+        sector_data[i][2] = 0x30;	    /* MIFARE read 16 bytes */
+        sector_data[i][3] = block + i;
+    }
+
+    /* data already holds key and UID */
+    data[0] = PN532_CMD_InDataExchange; /* 0x40 */
+    data[1] = 0x01;	/* card 1 */
+    data[2] = 0x60;	/* MIFARE authenticate A */
+    data[3] = block;
+    if ((res = rfid_submit(&data[0], 14, size, PN532_TIMEOUT_US, sector_auth_done, &sector_res[0])) < 0)
+        return res;
+
+    /* frames go out back-to-back as each response is drained */
+    while (rfid_pending()) {
+        rfid_poll();
+        rfid_idle();
+    }
+
+    return sector_res[0];
+}
+
+void store_block(uint8_t block, uint8_t *blockdata, uint8_t keyindex)
+{
+    debug_printf("Block:");
+    rfid_hexdump(&block, sizeof(block));
+    debug_printf("Data:");
+    rfid_hexdump(blockdata, BLOCK_SIZE);
+    debug_printf("Key:");
+    rfid_hexdump(&default_keys[keyindex], MIFARE_KEY_SIZE);
+
+    memcpy(&mifare_card[block*BLOCK_SIZE], blockdata, BLOCK_SIZE);
+    if (0x00 == (block+1) % 4) {
+        memcpy(&mifare_card[block*BLOCK_SIZE], &default_keys[keyindex], MIFARE_KEY_SIZE);
+        memcpy(&mifare_card[block*BLOCK_SIZE+6], &access_bytes[0], ACCESS_BYTES);
+        memcpy(&mifare_card[block*BLOCK_SIZE+10], &key_b[0], MIFARE_KEY_SIZE);
+    }
+}
+
 void loop_clone_rfid(uint8_t *menu, uint8_t *opmode)
 {
     uint8_t data[80];
     uint8_t keyindex = 0;
     uint8_t block = 0;
     uint8_t tries = 0;
+    uint8_t i, count;
     int res, oid;
 
 	get_firmware_version();
 
+	/* bounded retries instead of blocking on empty polls */
+	rfid_set_profile(RFID_PROFILE_ROBUST);
+
     while (block < BLOCKS) {
         if ( READ != *menu) { break; }
         res = mifare_reader_init(data, sizeof(data));
@@ -161,7 +243,11 @@ void loop_clone_rfid(uint8_t *menu, uint8_t *opmode)
                     set_uid(data, oid);
                     set_key(data, keyindex);
 
-                    res = mifare_authenticate_block(data, sizeof(data), block);
+                    count = SECTOR_BLOCKS - (block % SECTOR_BLOCKS);
+                    if (READ == *opmode)
+                        res = mifare_read_sector(data, sizeof(data), block, count);
+                    else
+                        res = mifare_authenticate_block(data, sizeof(data), block);
 
 /*
                     debug_printf("res:");
@@ -173,36 +259,29 @@ void loop_clone_rfid(uint8_t *menu, uint8_t *opmode)
 
                     if (0x41 == data[0] && 0x00 == data[1]) {
                         debug_printf("Auth Succeeded.\n");
-                        tries = 0;
 
                         switch (*opmode) {
                             case READ:
-                                res = mifare_read_block(data, sizeof(data), block);
-
-                                if (res == 18) {
-                                    debug_printf("Block:");
-                                    rfid_hexdump(&block, sizeof(block));
-                                    debug_printf("Data:");
-                                    rfid_hexdump(&data[2], BLOCK_SIZE);
-                                    debug_printf("Key:");
-                                    rfid_hexdump(&default_keys[keyindex], MIFARE_KEY_SIZE);
-
-                                    memcpy(&mifare_card[block*BLOCK_SIZE], &data[2], BLOCK_SIZE);
-                                    if (0x00 == (block+1) % 4) {
-                                        memcpy(&mifare_card[block*BLOCK_SIZE], &default_keys[keyindex], MIFARE_KEY_SIZE);
-                                        memcpy(&mifare_card[block*BLOCK_SIZE+6], &access_bytes[0], ACCESS_BYTES);
-                                        memcpy(&mifare_card[block*BLOCK_SIZE+10], &key_b[0], MIFARE_KEY_SIZE);
-                                    }
-                                }
+                                /* store blocks read behind the authentication */
+                                for (i = 0; i < count && sector_res[i + 1] == 18; i++)
+                                    store_block(block + i, &sector_data[i][2], keyindex);
+                                /* continue with first block not read - a failed
+                                   first read is retried, counted like a wrong key */
+                                if (i) {
+                                    tries = 0;
+                                    block += i;
+                                } else
+                                    tries += 1;
                             break;
                             case WRITE:
+                                tries = 0;
                                 memcpy(&data[4], &mifare_card[block*BLOCK_SIZE], BLOCK_SIZE);
                                 res = mifare_write_block(data, sizeof(data), block);
                                 debug_printf("res:");
                                 rfid_hexdump(&res, sizeof(res));
+                                block += 1;
                             break;
                         }
-                        block += 1;
                     } else if (0x41 == data[0] && 0x14 == data[1]) {
                         debug_printf("Auth Failed.\n");
                         keyindex = (keyindex + 1) % KEYS;
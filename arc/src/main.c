@@ -12,6 +12,10 @@ extern uint8_t mode;// = READ;
 
 extern uint32_t clock_1s;
 
+static BOOL libnfc_running(void)
+{
+	return main_menu == LIBNFC;
+}
 
 void ButtonInit(void)
 {
@@ -73,6 +77,9 @@ int main(void)
 	/* Init RFID SPI interface */
 	rfid_init();
 
+	/* pick the fastest PN532 SPI clock that survives an echo test */
+	rfid_calibrate();
+
 	debug_printf("OpenPCD2 vTROOPERS15\n");
 
 	/* show LED to signal initialization */
@@ -95,7 +102,8 @@ int main(void)
     while (1) {
         switch (main_menu) {
             case LIBNFC:
-                loop_libnfc_rfid(&main_menu);
+                get_firmware_version();
+                loop_libnfc_rfid(libnfc_running);
                 break;
             case CLONE:
                 loop_clone_rfid(&main_menu, &mode);
@@ -21,129 +21,321 @@
 
  */
 #include <openbeacon.h>
+#include <printf.h>
 #include "usbserial.h"
 
 #define FIFO_SIZE (USB_CDC_BUFSIZE * 2)
+#define FIFO_MASK (FIFO_SIZE - 1)
 
+#if FIFO_SIZE & FIFO_MASK
+#error FIFO_SIZE needs to be a power of two
+#endif
+
+/* usb_write gives up once the host fetched no packet for this long */
+#ifndef USB_WRITE_STALL_US
+#define USB_WRITE_STALL_US 100000UL
+#endif /*USB_WRITE_STALL_US */
+
+/* single producer, single consumer ring - head is only written by
+   the producer, tail only by the consumer. Both indices run freely
+   and wrap at 2^16, their difference is the fill level. */
 typedef struct
 {
-	uint8_t buffer[FIFO_SIZE];
-	uint16_t head, tail, count;
+	/* word aligned for direct endpoint writes */
+	uint8_t buffer[FIFO_SIZE] __attribute__ ((aligned (4)));
+	volatile uint16_t head, tail;
 } TFIFO;
 
+/* order buffer accesses against index updates */
+#define FIFO_BARRIER() __asm__ __volatile__ ("dmb":::"memory")
+
 BOOL CDC_DepInEmpty;
+/* OUT endpoint holds a packet back till fifo_BulkOut has room */
+static volatile BOOL CDC_DepOutNAK;
 TFIFO fifo_BulkIn, fifo_BulkOut;
 
-int
-usb_putchar_irq (TFIFO * fifo, uint8_t data)
+static inline uint16_t
+fifo_count (const TFIFO * fifo)
 {
-	if (fifo->count >= FIFO_SIZE)
-		return -1;
+	return (uint16_t) (fifo->head - fifo->tail);
+}
 
-	/* add data to FIFO */
-	fifo->count++;
-	fifo->buffer[fifo->head++] = data;
+static int
+fifo_write (TFIFO * fifo, const uint8_t * data, int len)
+{
+	uint16_t head, pos, space;
+	int run;
+
+	head = fifo->head;
+	space = FIFO_SIZE - (uint16_t) (head - fifo->tail);
+	if (len > space)
+		len = space;
+
+	/* copy up to the wrap point, remainder to the start */
+	pos = head & FIFO_MASK;
+	run = FIFO_SIZE - pos;
+	if (run > len)
+		run = len;
+	memcpy (&fifo->buffer[pos], data, run);
+	memcpy (fifo->buffer, &data[run], len - run);
+
+	FIFO_BARRIER ();
+	fifo->head = head + len;
+
+	return len;
+}
 
-	/* handle wrapping */
-	if (fifo->head == FIFO_SIZE)
-		fifo->head = 0;
+static int
+fifo_read (TFIFO * fifo, uint8_t * data, int len)
+{
+	uint16_t tail, pos, count;
+	int run;
+
+	tail = fifo->tail;
+	count = (uint16_t) (fifo->head - tail);
+	if (len > count)
+		len = count;
+	FIFO_BARRIER ();
+
+	/* copy up to the wrap point, remainder from the start */
+	pos = tail & FIFO_MASK;
+	run = FIFO_SIZE - pos;
+	if (run > len)
+		run = len;
+	memcpy (data, &fifo->buffer[pos], run);
+	memcpy (&data[run], fifo->buffer, len - run);
+
+	FIFO_BARRIER ();
+	fifo->tail = tail + len;
+
+	return len;
+}
 
-	return 0;
+static void
+usb_rx_rearm (void)
+{
+	/* resume OUT endpoint once a full packet fits */
+	if (CDC_DepOutNAK
+		&& (FIFO_SIZE - fifo_count (&fifo_BulkOut)) >= USB_CDC_BUFSIZE)
+	{
+		/* endpoint is shared with the USB IRQ */
+		__disable_irq ();
+		CDC_BulkOut ();
+		__enable_irq ();
+	}
 }
 
 int
-usb_getchar_irq (TFIFO * fifo)
+usb_getchar (void)
 {
+	uint16_t tail;
 	int res;
 
-	if (!fifo->count)
+	tail = fifo_BulkOut.tail;
+	if (fifo_BulkOut.head == tail)
 		return -1;
+	FIFO_BARRIER ();
 
-	/* get data from FIFO */
-	fifo->count--;
-	res = fifo->buffer[fifo->tail++];
+	res = fifo_BulkOut.buffer[tail & FIFO_MASK];
 
-	/* handle wrapping */
-	if (fifo->tail == FIFO_SIZE)
-		fifo->tail = 0;
+	FIFO_BARRIER ();
+	fifo_BulkOut.tail = tail + 1;
+
+	usb_rx_rearm ();
 
 	return res;
 }
 
 int
-usb_getchar (void)
+usb_read (void *buf, int len)
 {
 	int res;
 
-	__disable_irq ();
-	res = usb_getchar_irq (&fifo_BulkOut);
-	__enable_irq ();
+	res = fifo_read (&fifo_BulkOut, (uint8_t *) buf, len);
+	usb_rx_rearm ();
 
 	return res;
 }
 
+int
+usb_rx_pending (void)
+{
+	return fifo_count (&fifo_BulkOut);
+}
+
 int
 usb_putchar (uint8_t data)
 {
-	int res;
+	uint16_t head;
 
-	__disable_irq ();
 	/* if USB FIFO is full - flush */
-	if (fifo_BulkIn.count >= USB_CDC_BUFSIZE)
-		CDC_BulkIn ();
-	/* store new data in FIFO */
-	res = usb_putchar_irq (&fifo_BulkIn, data);
-	__enable_irq ();
+	if (fifo_count (&fifo_BulkIn) >= USB_CDC_BUFSIZE)
+		usb_flush ();
+
+	head = fifo_BulkIn.head;
+	if ((uint16_t) (head - fifo_BulkIn.tail) >= FIFO_SIZE)
+		return -1;
+
+	fifo_BulkIn.buffer[head & FIFO_MASK] = data;
+
+	FIFO_BARRIER ();
+	fifo_BulkIn.head = head + 1;
+
+	return 0;
+}
+
+int
+usb_write (const void *buf, int len)
+{
+	const uint8_t *p;
+	int res, n;
+	uint16_t tail;
+	uint32_t start;
+
+	p = (const uint8_t *) buf;
+	res = 0;
+	tail = fifo_BulkIn.tail;
+	start = DWT_CYCCNT;
+	while (res < len)
+	{
+		n = fifo_write (&fifo_BulkIn, &p[res], len - res);
+		res += n;
+
+		/* if USB FIFO is full - flush, stall till the host
+		   fetched a packet, a host that stopped reading gets
+		   a short write */
+		if (fifo_count (&fifo_BulkIn) >= USB_CDC_BUFSIZE)
+		{
+			if (!USB_Configuration)
+				break;
+			if (tail != fifo_BulkIn.tail)
+			{
+				tail = fifo_BulkIn.tail;
+				start = DWT_CYCCNT;
+			}
+			else if ((DWT_CYCCNT - start) >=
+					 USB_WRITE_STALL_US * (SystemCoreClock / 1000000))
+				break;
+			usb_flush ();
+		}
+		else if (!n)
+			break;
+	}
 
 	return res;
 }
 
+uint8_t *
+usb_tx_reserve (uint16_t offset, uint16_t * len)
+{
+	uint16_t space, pos;
+
+	space = FIFO_SIZE - fifo_count (&fifo_BulkIn);
+
+	/* region past FIFO head is only owned by the writer */
+	if (offset >= space)
+	{
+		*len = 0;
+		return NULL;
+	}
+	space -= offset;
+
+	pos = (fifo_BulkIn.head + offset) & FIFO_MASK;
+
+	/* limit to contiguous storage */
+	if (space > (FIFO_SIZE - pos))
+		space = FIFO_SIZE - pos;
+	if (*len > space)
+		*len = space;
+
+	return &fifo_BulkIn.buffer[pos];
+}
+
+void
+usb_tx_commit (uint16_t len)
+{
+	/* publish data written via usb_tx_reserve */
+	FIFO_BARRIER ();
+	fifo_BulkIn.head += len;
+
+	/* if USB FIFO is full - flush */
+	if (fifo_count (&fifo_BulkIn) >= USB_CDC_BUFSIZE)
+		usb_flush ();
+}
+
+static void
+usb_putc (void *p, char c)
+{
+	(void) p;
+
+	if (c == '\n')
+		usb_putchar ('\r');
+
+	usb_putchar (c);
+}
+
+void
+usb_printf (const char *fmt, ...)
+{
+	va_list va;
+
+	va_start (va, fmt);
+	tfp_format (NULL, usb_putc, fmt, va);
+	va_end (va);
+
+	usb_flush ();
+}
+
 void
 CDC_BulkIn (void)
 {
 	uint8_t *p;
 	uint32_t data;
-	uint16_t count;
+	uint16_t tail, pos, count, i, j;
 
-	if (!fifo_BulkIn.count)
+	tail = fifo_BulkIn.tail;
+	count = (uint16_t) (fifo_BulkIn.head - tail);
+	if (!count)
 		return;
 
-	if (fifo_BulkIn.count > USB_CDC_BUFSIZE)
+	/* host has not fetched the previous packets yet - the USB IRQ
+	   calls again once an endpoint buffer is free */
+	if (USB_EP_Full (CDC_DEP_IN))
+		return;
+	FIFO_BARRIER ();
+
+	if (count > USB_CDC_BUFSIZE)
 		count = USB_CDC_BUFSIZE;
-	else
-		count = fifo_BulkIn.count;
 
 	USB_WriteEP_Count (CDC_DEP_IN, count);
 
-	while (count > 0)
+	for (i = 0; i < count; i += sizeof (data))
 	{
-		if (count < (int) sizeof (data))
+		pos = (tail + i) & FIFO_MASK;
+		if (!(pos & 3) && (count - i) >= (int) sizeof (data))
+			/* aligned words never wrap - pass storage through */
+			data = *((uint32_t *) & fifo_BulkIn.buffer[pos]);
+		else
 		{
 			data = 0;
 			p = (uint8_t *) & data;
-			while (count)
-			{
-				count--;
-				*p++ = usb_getchar_irq (&fifo_BulkIn);
-			}
-		}
-		else
-		{
-			((uint8_t *) & data)[0] = usb_getchar_irq (&fifo_BulkIn);
-			((uint8_t *) & data)[1] = usb_getchar_irq (&fifo_BulkIn);
-			((uint8_t *) & data)[2] = usb_getchar_irq (&fifo_BulkIn);
-			((uint8_t *) & data)[3] = usb_getchar_irq (&fifo_BulkIn);
-			count -= 4;
+			for (j = i; j < count && j < (i + sizeof (data)); j++)
+				*p++ = fifo_BulkIn.buffer[(tail + j) & FIFO_MASK];
 		}
 		USB_WriteEP_Block (data);
 	}
 
 	USB_WriteEP_Terminate (CDC_DEP_IN);
+
+	/* release transmitted packet */
+	FIFO_BARRIER ();
+	fifo_BulkIn.tail = tail + count;
 }
 
 void
 usb_flush (void)
 {
+	/* endpoint is shared with the USB IRQ */
 	__disable_irq ();
 	CDC_BulkIn ();
 	__enable_irq ();
@@ -154,21 +346,43 @@ CDC_BulkOut (void)
 {
 	int count, bs;
 	uint32_t block;
+	uint16_t head;
 	uint8_t *p;
 
-	count = USB_ReadEP_Count (CDC_DEP_OUT);
-
-	while (count > 0)
+	/* double buffered endpoint - drain every packet that fits */
+	while (USB_EP_Full (CDC_DEP_OUT))
 	{
-		block = USB_ReadEP_Block ();
-		bs = (count > (int) sizeof (block)) ? (int) sizeof (block) : count;
-		count -= bs;
-		p = (unsigned char *) &block;
-		while (bs--)
-			usb_putchar_irq (&fifo_BulkOut, *p++);
+		head = fifo_BulkOut.head;
+
+		/* leave packet unread, host gets NAKed till usb_getchar
+		   or usb_read made room for a full packet */
+		if ((FIFO_SIZE - (uint16_t) (head - fifo_BulkOut.tail)) <
+			USB_CDC_BUFSIZE)
+		{
+			CDC_DepOutNAK = TRUE;
+			return;
+		}
+
+		count = USB_ReadEP_Count (CDC_DEP_OUT);
+
+		while (count > 0)
+		{
+			block = USB_ReadEP_Block ();
+			bs = (count > (int) sizeof (block)) ? (int) sizeof (block) : count;
+			count -= bs;
+			p = (unsigned char *) &block;
+			while (bs--)
+				fifo_BulkOut.buffer[(head++) & FIFO_MASK] = *p++;
+		}
+
+		USB_ReadEP_Terminate (CDC_DEP_OUT);
+
+		/* publish received packet */
+		FIFO_BARRIER ();
+		fifo_BulkOut.head = head;
 	}
 
-	USB_ReadEP_Terminate (CDC_DEP_OUT);
+	CDC_DepOutNAK = FALSE;
 }
 
 void
@@ -177,6 +391,7 @@ usb_init (void)
 	/* initialize buffers */
 	bzero (&fifo_BulkIn, sizeof (fifo_BulkIn));
 	bzero (&fifo_BulkOut, sizeof (fifo_BulkOut));
+	CDC_DepOutNAK = FALSE;
 
 	CDC_Init ();
 	/* USB Initialization */
@@ -0,0 +1,51 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - native stand-in for openbeacon.h to build the
+ *                  PN532 frame parser on the development host
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef __OPENBEACON_H__
+#define __OPENBEACON_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t BOOL;
+#define TRUE 1
+#define FALSE 0
+
+/* parser only - no USB bridge on the host */
+#define ENABLE_PN532_RFID
+
+#define debug_printf printf
+#ifdef  DEBUG
+#define debug(args...) debug_printf(args)
+#else /*DEBUG */
+#define debug(...) {}
+#endif /*DEBUG */
+
+static inline void
+pmu_wait_ms (uint32_t ms)
+{
+	(void) ms;
+}
+
+#endif/*__OPENBEACON_H__*/
@@ -25,7 +25,16 @@
 #define __DEFAULT_PMU_H__
 #ifndef DISABLE_DEFAULT_PMU
 
+/* Cortex-M3 DWT cycle counter, not covered by this CMSIS revision */
+#define DWT_CTRL (*((volatile uint32_t *) 0xE0001000))
+#define DWT_CYCCNT (*((volatile uint32_t *) 0xE0001004))
+#define DWT_CTRL_CYCCNTENA (1UL << 0)
+
 extern void pmu_wait_ms (uint16_t ms);
+extern void pmu_wait_us (uint16_t us);
+extern void pmu_timeout_start (uint32_t us);
+extern BOOL pmu_timeout_expired (void);
+extern void pmu_timeout_stop (void);
 extern void pmu_init (void);
 
 #endif/*DISABLE_DEFAULT_PMU*/
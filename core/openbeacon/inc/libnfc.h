@@ -0,0 +1,80 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - PN532 frame parser and libnfc USB bridge
+ *
+ * Copyright 2012 Milosch Meriac <meriac@openbeacon.de>
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef __LIBNFC_H__
+#define __LIBNFC_H__
+
+#include <pn532.h>
+
+/* reserved byte, extended header, payload, DCS and postamble */
+#define PN532_MAX_PACKET_SIZE (PN532_MAX_PAYLOAD_SIZE+11)
+
+/* vendor batch frames, TFI values libnfc never uses */
+#define LIBNFC_TFI_BATCH 0xD6
+#define LIBNFC_TFI_BATCH_RESPONSE 0xD7
+/* batch flags: stop at first failing command */
+#define LIBNFC_BATCH_ABORT 0x01
+
+typedef enum
+{
+	STATE_IDLE = 0,
+	STATE_PREFIX = -1,
+	STATE_PREFIX_EXT = -2,
+	STATE_HEADER = -3,
+	STATE_WAKEUP = -4,
+	STATE_FIFOFLUSH = -5,
+	STATE_PAYLOAD = -6,
+	STATE_FLOWCTRL = -7
+} PN532_State;
+
+typedef struct
+{
+	uint32_t last_seen;
+	uint16_t reserved;
+	uint16_t pos;
+	uint16_t expected;
+	uint8_t data_prev;
+	uint8_t wakeup;
+	uint8_t crc;
+	uint8_t tfi;
+	PN532_State state;
+	uint8_t data[PN532_MAX_PACKET_SIZE + 1];
+} PN532_Packet;
+
+/* bridge keeps running while this returns TRUE, called once per loop */
+typedef BOOL (*TLibnfcRunning) (void);
+
+extern void packet_init (PN532_Packet * pkt, uint8_t reserved, uint8_t tfi);
+extern void packet_reset (PN532_Packet * pkt);
+extern int packet_put (PN532_Packet * pkt, uint8_t data);
+extern int packet_put_buf (PN532_Packet * pkt, const uint8_t * data, int len,
+						   int *used);
+extern void dump_packet (const uint8_t * data, int count);
+extern void rfid_hexdump (const void *buffer, int size);
+
+#if defined ENABLE_PN532_RFID && defined ENABLE_USB_FULLFEATURED
+extern void get_firmware_version (void);
+extern void loop_libnfc_rfid (TLibnfcRunning running);
+#endif /*ENABLE_PN532_RFID && ENABLE_USB_FULLFEATURED */
+
+#endif/*__LIBNFC_H__*/
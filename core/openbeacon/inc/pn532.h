@@ -27,6 +27,8 @@
 /* PN532 Hardware Settings */
 #define PN532_FIFO_SIZE 64
 #define PN532_ACK_NACK_SIZE 6
+/* maximum payload of an extended information frame, excluding TFI */
+#define PN532_MAX_PAYLOAD_SIZE 264
 
 /* PN532 Miscellaneous command set */
 #define PN532_CMD_Diagnose 0x00
@@ -68,4 +70,27 @@
 #define PN532_CMD_TgResponseToInitiator 0x90
 #define PN532_CMD_TgGetTargetStatus 0x8A
 
+/* PN532 CIU registers */
+#define PN532_CIU_TxMode 0x6302
+#define PN532_CIU_RxMode 0x6303
+#define PN532_CIU_BitFraming 0x633D
+/* TxCRCEn/RxCRCEn bit in CIU TxMode/RxMode */
+#define PN532_CIU_CRC_EN 0x80
+
+/* ISO/IEC 14443 type A card commands */
+#define ISO14443A_REQA 0x26
+#define ISO14443A_WUPA 0x52
+#define ISO14443A_HLTA 0x50
+#define ISO14443A_READ 0x30
+#define ISO14443A_FAST_READ 0x3A
+
+/* PN532 PowerDown WakeUpEnable sources */
+#define PN532_WAKEUP_INT0 (1<<0)
+#define PN532_WAKEUP_INT1 (1<<1)
+#define PN532_WAKEUP_RF (1<<3)
+#define PN532_WAKEUP_HSU (1<<4)
+#define PN532_WAKEUP_SPI (1<<5)
+#define PN532_WAKEUP_GPIO (1<<6)
+#define PN532_WAKEUP_I2C (1<<7)
+
 #endif/*__PN532_H__*/
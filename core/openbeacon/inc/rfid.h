@@ -25,16 +25,247 @@
 #ifdef  ENABLE_PN532_RFID
 
 #include <pn532.h>
+#include <spi.h>
+
+/* default time to wait for a PN532 response */
+#define PN532_TIMEOUT_US 100000UL
+
+/* link recovery: time to wait for an ACK frame, retransmissions per
+   escalation level and total time budget of the recovery ladder */
+#ifndef RFID_ACK_TIMEOUT_US
+#define RFID_ACK_TIMEOUT_US 10000UL
+#endif /*RFID_ACK_TIMEOUT_US */
+#ifndef RFID_LINK_RETRIES
+#define RFID_LINK_RETRIES 2
+#endif /*RFID_LINK_RETRIES */
+#ifndef RFID_LINK_BUDGET_US
+#define RFID_LINK_BUDGET_US 50000UL
+#endif /*RFID_LINK_BUDGET_US */
+/* PN532 hardware reset pulse, maximum boot time and SPI wakeup time */
+#ifndef RFID_RESET_PULSE_US
+#define RFID_RESET_PULSE_US 1000
+#endif /*RFID_RESET_PULSE_US */
+#ifndef RFID_RESET_BOOT_US
+#define RFID_RESET_BOOT_US 100000UL
+#endif /*RFID_RESET_BOOT_US */
+#ifndef RFID_WAKEUP_US
+#define RFID_WAKEUP_US 2000
+#endif /*RFID_WAKEUP_US */
+
+/* checksum errors in a row before slowing down the SPI clock */
+#ifndef RFID_SPI_FALLBACK_ERRORS
+#define RFID_SPI_FALLBACK_ERRORS 3
+#endif /*RFID_SPI_FALLBACK_ERRORS */
+
+/* Diagnose echo frames needed per step during SPI clock calibration */
+#ifndef RFID_CALIBRATE_ROUNDS
+#define RFID_CALIBRATE_ROUNDS 8
+#endif /*RFID_CALIBRATE_ROUNDS */
+
+/* maximum number of queued asynchronous commands */
+#ifndef RFID_QUEUE_SIZE
+#define RFID_QUEUE_SIZE 8
+#endif /*RFID_QUEUE_SIZE */
+
+/* maximum number of registers per ReadRegister/WriteRegister frame */
+#ifndef RFID_REGISTER_BATCH
+#define RFID_REGISTER_BATCH 16
+#endif /*RFID_REGISTER_BATCH */
+
+/* wire size of a pre-encoded normal information frame with len bytes
+   of PD0..PDn: SPI data write, preamble, LEN, LCS, TFI, DCS, postamble */
+#define RFID_FRAME_SIZE(len) ((len) + 9)
+
+/* sum of up to eight constant command bytes */
+#define RFID_FRAME_NARG(...) RFID_FRAME_NARG_(__VA_ARGS__,8,7,6,5,4,3,2,1)
+#define RFID_FRAME_NARG_(a,b,c,d,e,f,g,h,n,...) n
+#define RFID_FRAME_SUM(...) RFID_FRAME_SUM_(RFID_FRAME_NARG(__VA_ARGS__),__VA_ARGS__)
+#define RFID_FRAME_SUM_(n,...) RFID_FRAME_SUM__(n,__VA_ARGS__)
+#define RFID_FRAME_SUM__(n,...) RFID_FRAME_SUM##n(__VA_ARGS__)
+#define RFID_FRAME_SUM1(a) (a)
+#define RFID_FRAME_SUM2(a,...) ((a)+RFID_FRAME_SUM1(__VA_ARGS__))
+#define RFID_FRAME_SUM3(a,...) ((a)+RFID_FRAME_SUM2(__VA_ARGS__))
+#define RFID_FRAME_SUM4(a,...) ((a)+RFID_FRAME_SUM3(__VA_ARGS__))
+#define RFID_FRAME_SUM5(a,...) ((a)+RFID_FRAME_SUM4(__VA_ARGS__))
+#define RFID_FRAME_SUM6(a,...) ((a)+RFID_FRAME_SUM5(__VA_ARGS__))
+#define RFID_FRAME_SUM7(a,...) ((a)+RFID_FRAME_SUM6(__VA_ARGS__))
+#define RFID_FRAME_SUM8(a,...) ((a)+RFID_FRAME_SUM7(__VA_ARGS__))
+
+/* initializer for a complete host-to-PN532 wire frame, evaluated at
+   compile time - len (up to 254) may exceed the number of given command
+   bytes to pad PD0..PDn with zeros */
+#define RFID_FRAME(len,...) { 0x01, 0x00, 0x00, 0xFF, (len) + 1, \
+	(0x100 - ((len) + 1)) & 0xFF, 0xD4, __VA_ARGS__, \
+	[(len) + 7] = (0x100 - ((0xD4 + RFID_FRAME_SUM(__VA_ARGS__)) & 0xFF)) & 0xFF, \
+	0x00 }
+
+/* exponential backoff between SPI status polls */
+#ifndef RFID_STATUS_BACKOFF_MIN_US
+#define RFID_STATUS_BACKOFF_MIN_US 10
+#endif /*RFID_STATUS_BACKOFF_MIN_US */
+#ifndef RFID_STATUS_BACKOFF_MAX_US
+#define RFID_STATUS_BACKOFF_MAX_US 1280
+#endif /*RFID_STATUS_BACKOFF_MAX_US */
+/* backoff delays from here on sleep instead of spinning */
+#define RFID_STATUS_SLEEP_US 100
+
+/* PN532 response readiness detection */
+typedef enum
+{
+	RFID_READY_IRQ = 0,
+	RFID_READY_SPI_STATUS
+} TRfidReadyMode;
+
+#ifdef  PN532_READY_SPI_STATUS
+#define RFID_READY_DEFAULT RFID_READY_SPI_STATUS
+#else
+#define RFID_READY_DEFAULT RFID_READY_IRQ
+#endif /*PN532_READY_SPI_STATUS */
+
+/* latency histograms: tracked command codes, buckets and cycles of
+   bucket 0 as power of two (64 cycles ~ 1us at 72MHz) */
+#ifndef RFID_HIST_COMMANDS
+#define RFID_HIST_COMMANDS 4
+#endif /*RFID_HIST_COMMANDS */
+#ifndef RFID_HIST_BUCKETS
+#define RFID_HIST_BUCKETS 16
+#endif /*RFID_HIST_BUCKETS */
+#ifndef RFID_HIST_SHIFT
+#define RFID_HIST_SHIFT 6
+#endif /*RFID_HIST_SHIFT */
+
+/* phases of a PN532 command timed by the latency histograms */
+typedef enum
+{
+	RFID_PHASE_ENCODE = 0,
+	RFID_PHASE_WRITE,
+	RFID_PHASE_ACK,
+	RFID_PHASE_RESPONSE,
+	RFID_PHASE_READ,
+	RFID_PHASES
+} TRfidPhase;
+
+/* largest raw ISO14443A frame incl. CRC_A handled by
+   rfid_transceive_raw() in both directions */
+#ifndef RFID_RAW_FRAME_SIZE
+#define RFID_RAW_FRAME_SIZE 66
+#endif /*RFID_RAW_FRAME_SIZE */
+
+/* rfid_transceive_raw() flags: append and verify CRC_A in software */
+#define RFID_RAW_CRC 0x01
+
+/* RF timing profiles for rfid_set_profile() */
+typedef enum
+{
+	RFID_PROFILE_FAST_POLL = 0,
+	RFID_PROFILE_ROBUST,
+	RFID_PROFILE_EMULATION,
+	RFID_PROFILES
+} TRfidProfileId;
+
+/* states of the asynchronous command engine */
+typedef enum
+{
+	RFID_STATE_IDLE = 0,
+	RFID_STATE_SEND,
+	RFID_STATE_WRITE,
+	RFID_STATE_ACK,
+	RFID_STATE_RESPONSE,
+	RFID_STATE_DONE,
+	RFID_STATE_ERROR
+} TRfidState;
+
+/* SPI link state and error counters */
+typedef struct
+{
+	uint32_t spi_hz;
+	uint8_t step, cpsdvsr;
+	uint16_t crc_errors, fallbacks;
+	/* recovery ladder: NACK retransmits, ACK timeouts, response
+	   resend requests, FIFO flushes and hardware resets */
+	uint16_t retransmits, ack_timeouts, resends, flushes, resets;
+} TRfidStats;
+
+/* CIU register address/value pair for batched register access */
+typedef struct
+{
+	unsigned short address;
+	unsigned char data;
+} TRfidRegister;
+
+/* printf compatible output function for status reports */
+typedef void (*TRfidPrintf) (const char *fmt, ...);
+
+/* completion callback, res is the rfid_read() result - may run from
+   within the PN532 IRQ handler. Only rfid_submit* may be used from
+   here, synchronous calls fail with -10. Commands dropped by
+   rfid_abort() complete with -13 */
+typedef void (*TRfidCallback) (int res, void *data, void *context);
 
 extern void rfid_init (void);
 extern void rfid_reset (unsigned char reset);
-extern int rfid_read (void *data, unsigned char size);
+extern void rfid_recover (void);
+extern int rfid_power_down (unsigned char wakeup);
+extern void rfid_wake_up (void);
+/* PowerDown till timeout, returns 1 if woken early by RF activity -
+   IRQ ready mode only */
+extern int rfid_sleep (uint32_t timeout_us);
+extern int rfid_set_profile (TRfidProfileId id);
+/* raw transceive returns received bytes, -11 on CRC_A mismatch and -12
+   if PN532 reports a card error or timeout */
+extern int rfid_transceive_raw (const void *tx, int txlen, uint8_t last_bits,
+								void *rx, int rxsize, uint8_t flags);
+extern int rfid_wupa (unsigned char *atqa);
+extern int rfid_hlta (void);
+extern int rfid_fast_read (unsigned char start, unsigned char end,
+						   void *data, int size);
+/* PN532 response pending, follows the selected ready mode */
+extern BOOL rfid_ready (void);
+extern int rfid_wait_ready (uint32_t timeout_us);
+extern void rfid_set_ready_mode (TRfidReadyMode mode);
+extern void rfid_benchmark (TRfidPrintf print, int rounds);
+extern int rfid_read (void *data, uint16_t size);
+extern int rfid_read_timeout (void *data, uint16_t size, uint32_t timeout_us);
 extern int rfid_write (const void *data, int len);
 extern int rfid_write_register (unsigned short address, unsigned char data);
 extern int rfid_mask_register (unsigned short address, unsigned char data,
 							   unsigned char mask);
 extern int rfid_read_register (unsigned short address);
+extern int rfid_read_registers (const unsigned short *address,
+								unsigned char *data, int count);
+extern int rfid_write_registers (const TRfidRegister * reg, int count);
+extern int rfid_mask_registers (TRfidRegister * reg,
+								const unsigned char *mask, int count);
 extern int rfid_execute (void *data, unsigned int isize, unsigned int osize);
+extern int rfid_execute_timeout (void *data, unsigned int isize,
+								 unsigned int osize, uint32_t timeout_us);
+extern int rfid_submit (void *data, unsigned int isize, unsigned int osize,
+						uint32_t timeout_us, TRfidCallback callback,
+						void *context);
+extern int rfid_submit_frame (const void *frame, unsigned int size,
+							  void *data, unsigned int osize,
+							  uint32_t timeout_us, TRfidCallback callback,
+							  void *context);
+extern int rfid_send_frame (const void *frame, unsigned int size);
+extern int rfid_execute_frame (const void *frame, unsigned int size,
+							   void *data, unsigned int osize);
+extern int rfid_pending (void);
+extern int rfid_poll (void);
+extern void rfid_idle (void);
+extern void rfid_abort (void);
+extern int rfid_calibrate (void);
+extern spi_cs rfid_spi_cs (void);
+/* DWT cycle count of the last PN532 IRQ edge, IRQ ready mode only */
+extern uint32_t rfid_irq_cycles (void);
+extern const TRfidStats *rfid_stats (void);
+extern void rfid_status (TRfidPrintf print);
+extern void rfid_histogram (TRfidPrintf print);
+extern void rfid_histogram_reset (void);
+
+extern const unsigned char rfid_frame_get_firmware_version[RFID_FRAME_SIZE (1)];
+extern const unsigned char rfid_frame_sam_configuration[RFID_FRAME_SIZE (2)];
+extern const unsigned char rfid_frame_in_list_passive_target[RFID_FRAME_SIZE (3)];
+extern const unsigned char rfid_frame_rf_field_off[RFID_FRAME_SIZE (3)];
 
 #endif /*ENABLE_PN532_RFID */
 #endif/*__RFID_H__*/
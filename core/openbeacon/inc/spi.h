@@ -36,14 +36,32 @@ typedef uint32_t spi_cs;
 #define SPI_CS_MODE_LCD (SPI_CS_MODE_LCD_CMD|SPI_CS_MODE_LCD_DAT)
 
 #define SPI_CS_MODE_SKIP_CS (SPI_CS_MODE_SKIP_CS_ASSERT|SPI_CS_MODE_SKIP_CS_DEASSERT)
-#define SPI_CS(port,pin,CPSDVSR,mode) ((spi_cs)( ((((uint32_t)port)&0xFF)<<24) | ((((uint32_t)pin)&0xFF)<<16) | ((((uint32_t)CPSDVSR)&0xFF)<<8) | (((uint32_t)mode)&0xFF) ))
+#define SPI_CS(port,pin,CPSDVSR,delay_us,mode) ((spi_cs)( ((((uint32_t)port)&0x0F)<<28) | ((((uint32_t)pin)&0x0F)<<24) | ((((uint32_t)delay_us)&0xFF)<<16) | ((((uint32_t)CPSDVSR)&0xFF)<<8) | (((uint32_t)mode)&0xFF) ))
+
+#define SPI_CS_PORT(cs) ((uint8_t)(((cs)>>28)&0x0F))
+#define SPI_CS_PIN(cs) ((uint8_t)(((cs)>>24)&0x0F))
+#define SPI_CS_DELAY_US(cs) ((uint8_t)(((cs)>>16)&0xFF))
+#define SPI_CS_CPSDVSR(cs) ((uint8_t)(((cs)>>8)&0xFF))
+#define SPI_CS_SET_CPSDVSR(cs,CPSDVSR) ((spi_cs)(((cs)&~0xFF00UL)|((((uint32_t)CPSDVSR)&0xFF)<<8)))
+
+/* completion callback of interrupt driven transfers, runs in SSP IRQ or
+   in CT16B1 IRQ after the chip select hold time */
+typedef void (*TSpiCallback) (int res, void *context);
 
 extern void spi_init (void);
 extern void spi_close (void);
 extern void spi_status (void);
 extern void spi_init_pin (spi_cs chipselect);
+extern void spi_txrx_begin (spi_cs chipselect);
+extern void spi_txrx_burst (spi_cs chipselect, const void *tx, void *rx,
+							uint16_t len);
 extern void spi_txrx_done (spi_cs chipselect);
 extern int spi_txrx (spi_cs chipselect, const void *tx, uint16_t txlen,
 					 void *rx, uint16_t rxlen);
+extern int spi_txrx_async (spi_cs chipselect, const void *tx,
+						   uint16_t txlen, void *rx, uint16_t rxlen,
+						   TSpiCallback callback, void *context);
+extern BOOL spi_txrx_busy (void);
+extern void spi_txrx_wait (void);
 
 #endif/*__SPI_H__*/
@@ -59,6 +59,58 @@ pmu_wait_ms (uint16_t ms)
 		__WFI ();
 }
 
+void
+pmu_timeout_start (uint32_t us)
+{
+	uint32_t ticks;
+
+	/* round up to timer resolution, limit to 16 bit match register */
+	ticks = (us + (1000000UL / SYSTEM_TMR16B0_PRESCALER) - 1) /
+		(1000000UL / SYSTEM_TMR16B0_PRESCALER);
+	if (!ticks)
+		ticks = 1;
+	else if (ticks > 0xFFFF)
+		ticks = 0xFFFF;
+
+	/* prepare sleep */
+	LPC_PMU->PCON = (1 << 11) | (1 << 8);
+	SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+
+	/* start timer, timer IRQ will clear g_sleeping */
+	g_sleeping = TRUE;
+	LPC_TMR16B0->TC = 0;
+	LPC_TMR16B0->MR0 = ticks;
+	LPC_TMR16B0->TCR = 1;
+}
+
+BOOL
+pmu_timeout_expired (void)
+{
+	return !g_sleeping;
+}
+
+void
+pmu_timeout_stop (void)
+{
+	/* stop timer and discard pending match */
+	LPC_TMR16B0->TCR = 0;
+	LPC_TMR16B0->IR = 1;
+	NVIC_ClearPendingIRQ (TIMER_16_0_IRQn);
+	g_sleeping = FALSE;
+}
+
+void
+pmu_wait_us (uint16_t us)
+{
+	uint32_t start, cycles;
+
+	/* busy wait on the core cycle counter - too short for sleeping */
+	start = DWT_CYCCNT;
+	cycles = us * (SystemCoreClock / 1000000);
+
+	while ((DWT_CYCCNT - start) < cycles);
+}
+
 void
 pmu_init (void)
 {
@@ -76,6 +128,11 @@ pmu_init (void)
 
 	/* enable IRQ routine for TMR16B0 */
 	NVIC_EnableIRQ (TIMER_16_0_IRQn);
+
+	/* start DWT cycle counter for microsecond delays */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
 }
 
 #endif/*DISABLE_DEFAULT_PMU*/
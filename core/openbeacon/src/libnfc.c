@@ -0,0 +1,1056 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - PN532 frame parser and libnfc USB bridge
+ *
+ * Copyright 2012 Milosch Meriac <meriac@openbeacon.de>
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+#include <openbeacon.h>
+
+#ifdef  ENABLE_PN532_RFID
+
+#include "libnfc.h"
+
+#ifdef  ENABLE_USB_FULLFEATURED
+#define LIBNFC_BRIDGE
+#include "rfid.h"
+#include <usbserial.h>
+#endif /*ENABLE_USB_FULLFEATURED */
+
+/* host parser accepts PN532 commands and vendor batch frames */
+#define PACKET_TFI(pkt,x) ((x) == (pkt)->tfi || (x) == LIBNFC_TFI_BATCH)
+
+/* non-zero if any byte of word w equals b */
+#define WORD_HAS_ZERO(w) (((w) - 0x01010101UL) & ~(w) & 0x80808080UL)
+#define WORD_HAS_BYTE(w,b) WORD_HAS_ZERO((w) ^ (0x01010101UL * (b)))
+
+void
+packet_init (PN532_Packet * pkt, uint8_t reserved, uint8_t tfi)
+{
+	memset (pkt, 0, sizeof (*pkt));
+	pkt->reserved = reserved;
+	pkt->tfi = tfi;
+	pkt->data_prev = 0x01;
+}
+
+void
+packet_reset (PN532_Packet * pkt)
+{
+	/* frame bytes beyond pos are never read, leave data[] alone */
+	pkt->last_seen = 0;
+	pkt->pos = pkt->expected = 0;
+	pkt->wakeup = pkt->crc = 0;
+	pkt->data_prev = 0x01;
+	pkt->state = STATE_IDLE;
+}
+
+int
+packet_put (PN532_Packet * pkt, uint8_t data)
+{
+	PN532_State res;
+	uint8_t len, lcs;
+	uint16_t size;
+	const uint8_t prefix[] = { 0x00, 0x00, 0xFF };
+
+	res = pkt->state;
+
+	switch (pkt->state)
+	{
+		case STATE_WAKEUP:
+			debug ("\nWAKEUP\n");
+			pmu_wait_ms (50);
+			res = STATE_IDLE;
+			/* fall through - intentionally no 'break;' */
+
+		case STATE_IDLE:
+			/* if needed, delete packet from previous run */
+			if (pkt->pos)
+			{
+				packet_reset (pkt);
+				break;
+			}
+
+			/* scan for 0x00+0xFF prefix */
+			if (data == 0xFF && pkt->data_prev == 0x00)
+			{
+				memcpy (&pkt->data[pkt->reserved], prefix, sizeof (prefix));
+				/* add size of reserved+prefix to packet pos */
+				pkt->pos = pkt->reserved + sizeof (prefix);
+				/* expect at least a short frame */
+				pkt->expected = pkt->pos + 2;
+				/* switch to prefix reception mode */
+				res = STATE_FLOWCTRL;
+				break;
+			}
+
+			/* scan for HSU wakeup */
+			if (data == 0x55 && pkt->data_prev == 0x55)
+				/* wait for three times 0x00 */
+				pkt->wakeup = 3;
+			else if (pkt->wakeup)
+			{
+				if (data)
+					pkt->wakeup = 0;
+				else
+				{
+					pkt->wakeup--;
+					if (!pkt->wakeup)
+					{
+						res = STATE_WAKEUP;
+						break;
+					}
+				}
+			}
+			break;
+
+		case STATE_FLOWCTRL:
+			pkt->data[pkt->pos++] = data;
+			if (pkt->pos >= pkt->expected)
+			{
+				lcs = pkt->data[pkt->pos - 1];
+				len = pkt->data[pkt->pos - 2];
+
+				/* detected extended frame */
+				if (len == 0xFF && lcs == 0xFF)
+				{
+					debug ("IR: extended frame\n");
+					/* expect LENM, LENL, LCS and TFI */
+					pkt->expected += 4;
+					res = STATE_PREFIX_EXT;
+					break;
+				}
+
+				/* detected ACK or NACK frame */
+				if ((len == 0xFF && lcs == 0x00) ||
+					(len == 0x00 && lcs == 0xFF))
+				{
+					res = pkt->pos;
+					break;
+				}
+
+				pkt->expected++;
+				res = STATE_PREFIX;
+			}
+			break;
+
+		case STATE_PREFIX:
+			pkt->data[pkt->pos++] = data;
+			if (pkt->pos >= pkt->expected)
+			{
+				lcs = pkt->data[pkt->pos - 2];
+				len = pkt->data[pkt->pos - 3];
+
+				if (len == 0x01 && lcs == 0xFF)
+				{
+					pkt->expected += len;
+					pkt->crc = pkt->data[pkt->pos - 1];
+					res = STATE_PAYLOAD;
+					break;
+				}
+
+				/* if valid short packet */
+				if (((uint8_t) (len + lcs)) == 0)
+				{
+					pkt->expected += len;
+
+					/* detect oversized packets, check for TFI */
+					if ((pkt->expected > PN532_MAX_PACKET_SIZE) ||
+						!PACKET_TFI (pkt, data))
+					{
+						packet_reset (pkt);
+						res = STATE_IDLE;
+					}
+					else
+					{
+						/* maintain CRC including TFI */
+						pkt->crc = data;
+						res = STATE_PAYLOAD;
+					}
+				}
+				else
+				{
+					/* broken length checksum */
+					packet_reset (pkt);
+					res = STATE_IDLE;
+				}
+			}
+			break;
+
+		case STATE_PREFIX_EXT:
+			pkt->data[pkt->pos++] = data;
+			if (pkt->pos >= pkt->expected)
+			{
+				/* LENM, LENL, LCS and TFI */
+				lcs = pkt->data[pkt->pos - 2];
+				size = (pkt->data[pkt->pos - 4] << 8) | pkt->data[pkt->pos - 3];
+
+				/* LCS covers both length bytes */
+				if (((uint8_t) (pkt->data[pkt->pos - 4] +
+								pkt->data[pkt->pos - 3] + lcs)) ||
+					!size || size > PN532_MAX_PAYLOAD_SIZE)
+				{
+					debug ("IR: invalid extended frame\n");
+					packet_reset (pkt);
+					res = STATE_IDLE;
+					break;
+				}
+
+				/* check for TFI */
+				if (!PACKET_TFI (pkt, data))
+				{
+					packet_reset (pkt);
+					res = STATE_IDLE;
+					break;
+				}
+
+				/* remaining payload plus DCS */
+				pkt->expected += size;
+				/* maintain CRC including TFI */
+				pkt->crc = data;
+				res = STATE_PAYLOAD;
+			}
+			break;
+
+		case STATE_PAYLOAD:
+			pkt->data[pkt->pos++] = data;
+			pkt->crc += data;
+
+			if (pkt->pos >= pkt->expected)
+			{
+				if (pkt->crc)
+				{
+					debug ("IR: packet CRC error [0x%02X]\n", pkt->crc);
+					packet_reset (pkt);
+					res = STATE_IDLE;
+				}
+				else
+					res = pkt->pos;
+			}
+			break;
+
+		default:
+			debug ("IR: unknown state!!!\n");
+			packet_reset (pkt);
+			res = STATE_IDLE;
+	}
+
+	pkt->data_prev = data;
+	pkt->state = (res > 0) ? STATE_IDLE : res;
+
+	return res;
+}
+
+/* copy a payload run and return its byte sum, four bytes at a time -
+   the sum runs in two 16 bit lanes, each word adds at most 510 per
+   lane, so runs up to 512 bytes cannot overflow */
+static uint8_t
+packet_copy (uint8_t * dst, const uint8_t * src, int len)
+{
+	uint32_t word, acc;
+	uint8_t sum;
+
+	acc = 0;
+	for (; len >= (int) sizeof (word); len -= sizeof (word))
+	{
+		memcpy (&word, src, sizeof (word));
+		memcpy (dst, &word, sizeof (word));
+		acc += (word & 0x00FF00FFUL) + ((word >> 8) & 0x00FF00FFUL);
+		src += sizeof (word);
+		dst += sizeof (word);
+	}
+
+	sum = acc + (acc >> 16);
+	while (len--)
+		sum += *dst++ = *src++;
+
+	return sum;
+}
+
+/* parse a frame header that is completely in the buffer, p points to
+   the 0xFF of the 00 FF prefix - returns the number of bytes consumed
+   like packet_put would, or 0 if the header continues in the next
+   buffer */
+static int
+packet_put_header (PN532_Packet * pkt, const uint8_t * p, int avail,
+				   int *res)
+{
+	const uint8_t prefix[] = { 0x00, 0x00, 0xFF };
+	uint8_t len, lcs, tfi;
+	uint16_t size;
+	BOOL valid;
+	int n;
+
+	if (avail < 3)
+		return 0;
+	len = p[1];
+	lcs = p[2];
+
+	/* ACK/NACK frame, extended or short header up to TFI */
+	if ((len == 0xFF && lcs == 0x00) || (len == 0x00 && lcs == 0xFF))
+		n = 3;
+	else if (len == 0xFF && lcs == 0xFF)
+		n = 7;
+	else
+		n = 4;
+	if (avail < n)
+		return 0;
+
+	memcpy (&pkt->data[pkt->reserved], prefix, sizeof (prefix));
+	pkt->pos = pkt->reserved + sizeof (prefix);
+	memcpy (&pkt->data[pkt->pos], &p[1], n - 1);
+	pkt->pos += n - 1;
+	pkt->data_prev = p[n - 1];
+
+	if (n == 3)
+	{
+		pkt->state = STATE_IDLE;
+		*res = pkt->pos;
+		return n;
+	}
+
+	tfi = p[n - 1];
+	if (n == 7)
+	{
+		/* LCS covers both length bytes */
+		size = (p[3] << 8) | p[4];
+		valid = !((uint8_t) (p[3] + p[4] + p[5])) && size &&
+			(size <= PN532_MAX_PAYLOAD_SIZE) && PACKET_TFI (pkt, tfi);
+	}
+	else
+	{
+		size = len;
+		valid = (len == 0x01 && lcs == 0xFF) ||
+			(!((uint8_t) (len + lcs)) &&
+			 ((pkt->pos + size) <= PN532_MAX_PACKET_SIZE) &&
+			 PACKET_TFI (pkt, tfi));
+	}
+
+	if (!valid)
+	{
+		packet_reset (pkt);
+		pkt->data_prev = tfi;
+		*res = STATE_IDLE;
+		return n;
+	}
+
+	/* remaining payload plus DCS, CRC including TFI */
+	pkt->expected = pkt->pos + size;
+	pkt->crc = tfi;
+	pkt->state = STATE_PAYLOAD;
+	*res = STATE_PAYLOAD;
+	return n;
+}
+
+/* buffer-at-a-time packet_put: consumes bytes up to and including the
+   next frame boundary or state event, stores the number of consumed
+   bytes in *used and returns like packet_put. Headers split across
+   buffers and HSU wakeups fall back to packet_put */
+int
+packet_put_buf (PN532_Packet * pkt, const uint8_t * data, int len, int *used)
+{
+	uint32_t word;
+	int pos, run, res, n;
+
+	/* if needed, delete packet from previous run */
+	if (pkt->state == STATE_IDLE && pkt->pos)
+		packet_reset (pkt);
+
+	res = pkt->state;
+	pos = 0;
+	while (pos < len)
+	{
+		switch (pkt->state)
+		{
+			case STATE_IDLE:
+				if (!pkt->wakeup)
+				{
+					/* skip words without prefix or HSU wakeup bytes */
+					n = pos;
+					while ((len - pos) >= (int) sizeof (word))
+					{
+						memcpy (&word, &data[pos], sizeof (word));
+						if (WORD_HAS_BYTE (word, 0xFF) ||
+							WORD_HAS_BYTE (word, 0x55))
+							break;
+						pos += sizeof (word);
+					}
+					/* only 0xFF after 0x00 and 0x55 after 0x55 matter */
+					while (pos < len && data[pos] != 0xFF && data[pos] != 0x55)
+						pos++;
+					if (pos > n)
+						pkt->data_prev = data[pos - 1];
+					if (pos >= len)
+						break;
+
+					/* whole header in buffer - skip the state machine */
+					if (data[pos] == 0xFF && pkt->data_prev == 0x00 &&
+						(n = packet_put_header (pkt, &data[pos], len - pos,
+												&res)) > 0)
+					{
+						pos += n;
+						break;
+					}
+				}
+
+				res = packet_put (pkt, data[pos++]);
+				break;
+
+			case STATE_PAYLOAD:
+				/* copy payload run, CRC is checked at the end */
+				run = pkt->expected - pkt->pos;
+				if (run > (len - pos))
+					run = len - pos;
+				if (run > 0)
+				{
+					pkt->crc += packet_copy (&pkt->data[pkt->pos],
+											 &data[pos], run);
+					pkt->pos += run;
+					pos += run;
+					pkt->data_prev = data[pos - 1];
+				}
+
+				if (pkt->pos >= pkt->expected)
+				{
+					if (pkt->crc)
+					{
+						debug ("IR: packet CRC error [0x%02X]\n", pkt->crc);
+						packet_reset (pkt);
+						res = STATE_IDLE;
+					}
+					else
+					{
+						res = pkt->pos;
+						pkt->state = STATE_IDLE;
+					}
+				}
+				break;
+
+			default:
+				res = packet_put (pkt, data[pos++]);
+		}
+
+		/* stop at frame boundaries and state events */
+		if (res > 0 || res == STATE_WAKEUP || res == STATE_FIFOFLUSH)
+			break;
+	}
+
+	*used = pos;
+	return res;
+}
+
+void
+dump_packet (const uint8_t * data, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		debug_printf ("%c%02X", 6 == i % 7 ? '*' : ' ', *data++);
+	debug_printf ("\n");
+}
+
+void
+rfid_hexdump (const void *buffer, int size)
+{
+	int i;
+	const unsigned char *p = (const unsigned char *) buffer;
+
+	for (i = 0; i < size; i++)
+	{
+		if (i && ((i & 3) == 0))
+			debug_printf (" ");
+		debug_printf (" %02X", *p++);
+	}
+	debug_printf (" [size=%02i]\n", size);
+}
+
+#ifdef  LIBNFC_BRIDGE
+
+#ifndef FW_VERSION_TRIES
+/* attempts before giving up on the PN532 */
+#define FW_VERSION_TRIES 3
+#endif /*FW_VERSION_TRIES */
+
+/* host side parser, owned by the SSP while a frame is on the wire */
+static PN532_Packet g_libnfc_put;
+/* response frame of vendor batches, PN532 frames exceeding free
+   USB FIFO space */
+static uint8_t g_libnfc_frame[PN532_MAX_PACKET_SIZE + 1];
+
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+static const uint8_t g_libnfc_ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+/* PN532 application level error, fails a locally ACKed command */
+static const uint8_t g_libnfc_error[] =
+	{ 0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00 };
+/* host frames ACKed locally, still waiting for the PN532 ACK */
+static int g_libnfc_ack_pending;
+/* PN532 NACKs seen after a local ACK and commands failed towards
+   the host, dumped with '?' */
+static int g_libnfc_ack_nacks, g_libnfc_ack_failed;
+/* copy of the last forwarded command, kept till the PN532 ACKs it -
+   the parser buffer already belongs to the next host frame */
+static uint8_t g_libnfc_last[PN532_MAX_PACKET_SIZE + 1];
+static int g_libnfc_last_len, g_libnfc_last_tries;
+
+/* resends per command after a PN532 NACK */
+#ifndef LIBNFC_NACK_TRIES
+#define LIBNFC_NACK_TRIES 3
+#endif /*LIBNFC_NACK_TRIES */
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+
+#ifdef  ENABLE_LIBNFC_TIMESTAMPS
+/* DWT cycle counts of PN532 IRQ edge and last host frame written */
+static uint32_t g_libnfc_irq_cycles, g_libnfc_tx_cycles;
+/* IRQ edge already attributed to a forwarded frame */
+static uint32_t g_libnfc_irq_seen;
+
+static void
+libnfc_written (int res, void *context)
+{
+	(void) res;
+	(void) context;
+
+	g_libnfc_tx_cycles = DWT_CYCCNT;
+}
+
+/* append IRQ and SPI write time as little endian cycle counts,
+   followed by the core clock the host converts them with */
+static void
+libnfc_trailer (uint32_t irq_cycles)
+{
+	uint32_t stamp[3];
+
+	stamp[0] = irq_cycles;
+	stamp[1] = g_libnfc_tx_cycles;
+	stamp[2] = SystemCoreClock;
+
+	usb_write (stamp, sizeof (stamp));
+}
+
+#define LIBNFC_WRITTEN libnfc_written
+#else /*ENABLE_LIBNFC_TIMESTAMPS */
+#define LIBNFC_WRITTEN NULL
+#endif /*ENABLE_LIBNFC_TIMESTAMPS */
+
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+/* answer a locally ACKed frame towards the host */
+static void
+libnfc_reply (const uint8_t * frame, int size)
+{
+	usb_write (frame, size);
+#ifdef  ENABLE_LIBNFC_TIMESTAMPS
+	libnfc_trailer (0);
+#endif /*ENABLE_LIBNFC_TIMESTAMPS */
+	usb_flush ();
+}
+
+/* PN532 NACKed a locally ACKed frame: resend the private copy,
+   fail the command towards the host if that is not possible */
+static void
+libnfc_nacked (void)
+{
+	/* a NACK with frames still pending is not for the last copy */
+	if (g_libnfc_last_len && !g_libnfc_ack_pending &&
+		g_libnfc_last_tries++ < LIBNFC_NACK_TRIES &&
+		!spi_txrx_async (rfid_spi_cs (), g_libnfc_last, g_libnfc_last_len,
+						 NULL, 0, LIBNFC_WRITTEN, NULL))
+	{
+		g_libnfc_ack_pending++;
+		return;
+	}
+
+	g_libnfc_last_len = 0;
+	g_libnfc_ack_failed++;
+	libnfc_reply (g_libnfc_error, sizeof (g_libnfc_error));
+}
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+
+void
+get_firmware_version (void)
+{
+	int i, tries;
+	uint8_t output[PN532_FIFO_SIZE];
+
+	/* each try runs the full link recovery ladder of the rfid layer */
+	for (tries = 0; tries < FW_VERSION_TRIES; tries++)
+	{
+		if (((i = rfid_send_frame (rfid_frame_get_firmware_version,
+								   sizeof (rfid_frame_get_firmware_version)))
+			 == 0) && ((i = rfid_read (output, sizeof (output))) > 0))
+			break;
+
+		debug_printf ("fw_res=%i\n", i);
+		GPIOSetValue (LED_PORT, LED_BIT, LED_ON);
+		pmu_wait_ms (10);
+		GPIOSetValue (LED_PORT, LED_BIT, LED_OFF);
+	}
+
+	if (tries >= FW_VERSION_TRIES)
+	{
+		debug_printf ("PN532 not responding\n");
+		return;
+	}
+
+	if (output[1] == 0x32)
+		debug_printf ("PN532 firmware version: v%i.%i\n", output[2],
+					  output[3]);
+	else
+		debug ("Unknown firmware version\n");
+}
+
+/* run a vendor batch frame and answer with a single response frame:
+   request  TFI=0xD6 FLAGS {LEN CMD PARAMS...}*
+   response TFI=0xD7 COUNT {STATUS LEN DATA...}*
+   where STATUS is the negative rfid_execute error or zero */
+static int
+libnfc_batch (const uint8_t * req, int len, uint8_t * frame)
+{
+	uint8_t flags, count, crc, *p;
+	int pos, size, res, i;
+
+	/* skip TFI and flags */
+	flags = req[1];
+	req += 2;
+	len -= 2;
+
+	/* leave room for extended frame header, TFI and COUNT */
+	pos = 10;
+	count = 0;
+	while (len > 0)
+	{
+		size = *req++;
+		len--;
+		if (!size || size > len)
+			break;
+
+		/* STATUS and LEN, response must fit the extended frame */
+		p = &frame[pos + 2];
+		i = PN532_MAX_PAYLOAD_SIZE - (pos - 8) - 2;
+		if (i > 0xFF)
+			i = 0xFF;
+		if (i < size)
+			break;
+
+		memcpy (p, req, size);
+		req += size;
+		len -= size;
+
+		res = rfid_execute (p, size, i);
+		frame[pos] = (res < 0) ? (uint8_t) res : 0;
+		frame[pos + 1] = (res < 0) ? 0 : res;
+		pos += 2 + frame[pos + 1];
+		count++;
+
+		if (res < 0 && (flags & LIBNFC_BATCH_ABORT))
+			break;
+	}
+
+	/* TFI, COUNT and responses */
+	frame[8] = LIBNFC_TFI_BATCH_RESPONSE;
+	frame[9] = count;
+	size = pos - 8;
+
+	/* prepend short or extended header */
+	if (size < 0xFF)
+	{
+		p = &frame[3];
+		p[3] = size;
+		p[4] = -size;
+	}
+	else
+	{
+		p = &frame[0];
+		p[3] = p[4] = 0xFF;
+		p[5] = size >> 8;
+		p[6] = size;
+		p[7] = -(p[5] + p[6]);
+	}
+	p[0] = p[1] = 0x00;
+	p[2] = 0xFF;
+
+	/* DCS and postamble */
+	crc = 0;
+	for (i = 8; i < pos; i++)
+		crc += frame[i];
+	frame[pos++] = -crc;
+	frame[pos++] = 0x00;
+
+	/* one IN transfer */
+	usb_write (p, pos - (p - frame));
+#ifdef  ENABLE_LIBNFC_TIMESTAMPS
+	libnfc_trailer (0);
+#endif /*ENABLE_LIBNFC_TIMESTAMPS */
+	usb_flush ();
+
+	return count;
+}
+
+/* forward one PN532 frame to USB - the SPI burst lands directly in the
+   CDC IN FIFO storage and is validated there before it is published */
+static int
+libnfc_forward (void)
+{
+	uint8_t header[8], data, prev, tfi, crc, *p;
+	uint16_t size, total, pos, n, i, j;
+	BOOL control, buffered;
+	spi_cs cs;
+	int res;
+
+	cs = rfid_spi_cs ();
+	data = 0x03;
+	spi_txrx_begin (cs);
+	spi_txrx_burst (cs, &data, NULL, sizeof (data));
+
+	/* scan for 0x00+0xFF prefix */
+	header[0] = header[1] = 0x00;
+	header[2] = 0xFF;
+	data = 0x01;
+	for (i = 0; i < PN532_FIFO_SIZE; i++)
+	{
+		prev = data;
+		spi_txrx_burst (cs, NULL, &data, sizeof (data));
+		if (prev == 0x00 && data == 0xFF)
+			break;
+	}
+	if (i >= PN532_FIFO_SIZE)
+	{
+		res = -3;
+		goto done;
+	}
+
+	/* LEN+LCS, extended frames add LENM+LENL+LCS */
+	size = 5;
+	spi_txrx_burst (cs, NULL, &header[3], 2);
+	n = header[3];
+	crc = header[3] + header[4];
+	control = (crc == 0xFF) && (n == 0x00 || n == 0xFF);
+
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+	/* host already got a local ACK for this frame */
+	if (control && g_libnfc_ack_pending)
+	{
+		spi_txrx_burst (cs, NULL, &data, sizeof (data));
+		g_libnfc_ack_pending--;
+		if (n == 0xFF)
+		{
+			g_libnfc_ack_nacks++;
+			res = -1;
+		}
+		else
+		{
+			/* copy is no longer needed once the PN532 has it */
+			if (!g_libnfc_ack_pending)
+				g_libnfc_last_len = 0;
+			res = 0;
+		}
+		goto done;
+	}
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+
+	if (control)
+		/* ACK and NACK frames: only postamble is left */
+		total = 1;
+	else
+	{
+		if (n == 0xFF && header[4] == 0xFF)
+		{
+			spi_txrx_burst (cs, NULL, &header[size], 3);
+			n = (header[5] << 8) | header[6];
+			crc = header[5] + header[6] + header[7];
+			size += 3;
+		}
+		if (crc)
+		{
+			res = -4;
+			goto done;
+		}
+		if (!n || n > PN532_MAX_PAYLOAD_SIZE)
+		{
+			res = -5;
+			goto done;
+		}
+		/* TFI, payload, DCS and postamble */
+		total = n + 2;
+	}
+
+	/* frames exceeding free FIFO space are read into a private buffer
+	   and validated before blocking on the host */
+	n = 1;
+	if (!usb_tx_reserve (size + total - 1, &n))
+		usb_flush ();
+	n = 1;
+	buffered = (usb_tx_reserve (size + total - 1, &n) == NULL);
+
+	pos = 0;
+	tfi = crc = 0;
+	if (buffered)
+	{
+		memcpy (g_libnfc_frame, header, size);
+		p = &g_libnfc_frame[size];
+		spi_txrx_burst (cs, NULL, p, total);
+
+		tfi = p[0];
+		/* postamble is not covered by DCS */
+		for (j = 0; j < (total - 1); j++)
+			crc += p[j];
+	}
+	else
+	{
+		/* the header is the only part that gets copied */
+		for (i = 0; i < size; i += n)
+		{
+			n = size - i;
+			p = usb_tx_reserve (pos, &n);
+			memcpy (p, &header[i], n);
+			pos += n;
+		}
+
+		/* burst remaining frame straight into FIFO storage */
+		for (i = 0; i < total; i += n)
+		{
+			n = total - i;
+			p = usb_tx_reserve (pos, &n);
+			spi_txrx_burst (cs, NULL, p, n);
+
+			if (!i)
+				tfi = p[0];
+			/* validate in place, postamble is not covered by DCS */
+			for (j = 0; j < n && (i + j) < (total - 1); j++)
+				crc += p[j];
+
+			pos += n;
+		}
+	}
+
+	if (control)
+		res = size + total;
+	else if (crc)
+		res = -7;
+	else if (tfi != 0xD5 && !(total == 3 && tfi == 0x7F))
+		res = -6;
+	else
+		res = size + total;
+
+	/* publish validated frame, a host that stopped reading only gets
+	   the start of it and resyncs on the next preamble */
+	if (res > 0)
+	{
+		if (!buffered)
+			usb_tx_commit (pos);
+		else if (usb_write (g_libnfc_frame, size + total) < (size + total))
+		{
+			debug ("USB: host stalled, frame dropped\n");
+			res = -11;
+		}
+	}
+
+#ifdef  ENABLE_LIBNFC_TIMESTAMPS
+	if (res > 0)
+		libnfc_trailer (g_libnfc_irq_cycles);
+#endif /*ENABLE_LIBNFC_TIMESTAMPS */
+
+  done:
+	spi_txrx_done (cs);
+	usb_flush ();
+
+	return res;
+}
+
+static void
+libnfc_reset (void)
+{
+	/* reset PN532 */
+	GPIOSetValue (PN532_RESET_PORT, PN532_RESET_PIN, 0);
+	pmu_wait_ms (100);
+	GPIOSetValue (PN532_RESET_PORT, PN532_RESET_PIN, 1);
+	pmu_wait_ms (400);
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+	g_libnfc_ack_pending = 0;
+	g_libnfc_last_len = 0;
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+}
+
+void
+loop_libnfc_rfid (TLibnfcRunning running)
+{
+	int t, count, res, rx_pos, rx_len;
+	uint8_t rx[PN532_FIFO_SIZE], *p;
+	PN532_Packet *pkt;
+#ifdef  PN532_READY_SPI_STATUS
+	uint16_t backoff_us;
+#endif /*PN532_READY_SPI_STATUS */
+
+	debug_printf ("in libnfc\n");
+
+	pkt = &g_libnfc_put;
+	packet_init (pkt, 1, 0xD4);
+
+	/* run RFID loop */
+	t = rx_pos = rx_len = 0;
+#ifdef  PN532_READY_SPI_STATUS
+	backoff_us = RFID_STATUS_BACKOFF_MIN_US;
+#endif /*PN532_READY_SPI_STATUS */
+	while (running ())
+	{
+#ifdef  PN532_READY_SPI_STATUS
+		/* no IRQ line - sleep till next status poll, USB data or
+		   button press, backing off while the PN532 stays quiet */
+		__disable_irq ();
+		if (!rx_len && !usb_rx_pending ())
+		{
+			pmu_timeout_start (backoff_us);
+			__WFI ();
+			pmu_timeout_stop ();
+			if (backoff_us < RFID_STATUS_BACKOFF_MAX_US)
+				backoff_us <<= 1;
+		}
+		__enable_irq ();
+#else /*PN532_READY_SPI_STATUS */
+		/* sleep till PN532 IRQ edge, USB data or button press */
+		__disable_irq ();
+		if (GPIOGetValue (PN532_IRQ_PORT, PN532_IRQ_PIN)
+			&& !rx_len && !usb_rx_pending ())
+			__WFI ();
+		__enable_irq ();
+#endif /*PN532_READY_SPI_STATUS */
+
+		if (rfid_ready ())
+		{
+			GPIOSetValue (LED_PORT, LED_BIT, (t++) & 1);
+
+#ifdef  ENABLE_LIBNFC_TIMESTAMPS
+			/* prefer the edge captured by the rfid IRQ handler */
+			g_libnfc_irq_cycles = rfid_irq_cycles ();
+			if (g_libnfc_irq_cycles == g_libnfc_irq_seen)
+				g_libnfc_irq_cycles = DWT_CYCCNT;
+			else
+				g_libnfc_irq_seen = g_libnfc_irq_cycles;
+#endif /*ENABLE_LIBNFC_TIMESTAMPS */
+
+			/* one frame per chip select, IRQ stays low till drained */
+			for (count = 0; count < 4; count++)
+			{
+				res = libnfc_forward ();
+				debug ("RX: %i\n", res);
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+				if (res == -1)
+					libnfc_nacked ();
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+				if (!rfid_ready ())
+					break;
+			}
+#ifdef  PN532_READY_SPI_STATUS
+			/* response chains follow quickly */
+			backoff_us = RFID_STATUS_BACKOFF_MIN_US;
+#endif /*PN532_READY_SPI_STATUS */
+		}
+
+		/* pkt is owned by the SSP while a frame is on the wire */
+		while (!spi_txrx_busy ())
+		{
+			/* refill USB chunk once fully parsed */
+			if (!rx_len)
+			{
+				rx_pos = 0;
+				if (!(rx_len = usb_read (rx, sizeof (rx))))
+					break;
+			}
+
+#ifdef  DEBUG
+			/* '?' outside of a frame dumps PN532 link statistics to the
+			   debug UART - the CDC stream belongs to libnfc, so the
+			   byte still goes to the parser */
+			if (rx[rx_pos] == '?' && pkt->state == STATE_IDLE)
+			{
+				rfid_status (debug_printf);
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+				debug_printf ("early ACK: %i pending, %i NACKs, %i failed\n",
+							  g_libnfc_ack_pending, g_libnfc_ack_nacks,
+							  g_libnfc_ack_failed);
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+			}
+#endif /*DEBUG */
+
+			count = packet_put_buf (pkt, &rx[rx_pos], rx_len, &res);
+			rx_pos += res;
+			rx_len -= res;
+
+			switch (count)
+			{
+				case STATE_WAKEUP:
+					libnfc_reset ();
+					continue;
+
+				case STATE_FIFOFLUSH:
+					/* flush PN532 buffers */
+					pkt->data[0] = 0x01;
+					memset (&pkt->data[1], 0, PN532_FIFO_SIZE);
+					spi_txrx (rfid_spi_cs (), pkt->data, PN532_FIFO_SIZE + 1,
+							  NULL, 0);
+					continue;
+			}
+
+			if (count <= 0)
+				continue;
+
+			GPIOSetValue (LED_PORT, LED_BIT, (t++) & 1);
+
+			/* vendor batch frames are executed locally */
+			p = &pkt->data[(pkt->data[4] == 0xFF &&
+							pkt->data[5] == 0xFF) ? 9 : 6];
+			if (((uint8_t) (pkt->data[4] + pkt->data[5])) != 0xFF &&
+				*p == LIBNFC_TFI_BATCH)
+			{
+				res = libnfc_batch (p, &pkt->data[count - 1] - p,
+									g_libnfc_frame);
+				debug ("BATCH: %i\n", res);
+				continue;
+			}
+
+			pkt->data[0] = 0x01;
+			pkt->data[count++] = 0x00;
+			/* stream frame from SSP interrupts */
+			res = spi_txrx_async (rfid_spi_cs (), pkt->data, count, NULL, 0,
+								  LIBNFC_WRITTEN, NULL);
+#ifdef  PN532_READY_SPI_STATUS
+			/* poll for the PN532 ACK right away */
+			backoff_us = RFID_STATUS_BACKOFF_MIN_US;
+#endif /*PN532_READY_SPI_STATUS */
+#ifdef  ENABLE_LIBNFC_EARLY_ACK
+			/* ACK validated command frames right away,
+			   host ACK/NACK frames have LEN+LCS=0xFF */
+			if (!res && ((uint8_t) (pkt->data[4] + pkt->data[5])) != 0xFF)
+			{
+				memcpy (g_libnfc_last, pkt->data, count);
+				g_libnfc_last_len = count;
+				g_libnfc_last_tries = 0;
+				libnfc_reply (g_libnfc_ack, sizeof (g_libnfc_ack));
+				g_libnfc_ack_pending++;
+			}
+#endif /*ENABLE_LIBNFC_EARLY_ACK */
+#ifdef  DEBUG
+			debug ("TX: ");
+			dump_packet (&pkt->data[1], count - 1);
+#endif /*DEBUG */
+			break;
+		}
+	}
+}
+
+#endif /*LIBNFC_BRIDGE */
+
+#endif /*ENABLE_PN532_RFID */
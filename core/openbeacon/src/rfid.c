@@ -27,6 +27,151 @@
 #include "pn532.h"
 #include "rfid.h"
 
+/* map PN532_IRQ_PORT to its GPIO port interrupt handler */
+#define PN532_IRQ_HANDLER_NAME(port) PIOINT##port##_IRQHandler
+#define PN532_IRQ_HANDLER(port) PN532_IRQ_HANDLER_NAME(port)
+#define PN532_IRQ_IRQn ((IRQn_Type) (EINT0_IRQn - PN532_IRQ_PORT))
+
+/* pre-encoded frame header and trailer around the caller payload */
+typedef struct
+{
+	unsigned char hdr[10], hdr_len, trailer[2];
+} TRfidFrame;
+
+/* queued asynchronous command */
+typedef struct
+{
+	void *data;
+	unsigned int isize, osize;
+	uint32_t timeout_us;
+	TRfidCallback callback;
+	void *context;
+	TRfidFrame frame;
+	/* complete wire frame, replaces frame/data/isize if set */
+	const unsigned char *wire;
+	unsigned short wire_size;
+	/* command code for latency histograms */
+	unsigned char code;
+} TRfidCommand;
+
+/* state of the asynchronous command engine */
+typedef struct
+{
+	volatile TRfidState state;
+	TRfidCommand cmd;
+	uint32_t start, cycles;
+	int res;
+	volatile uint8_t segment;
+	uint16_t backoff_us;
+	uint32_t mark;
+	uint8_t retries;
+} TRfidAsync;
+
+/* cost of readiness detection, reported by rfid_benchmark() */
+typedef struct
+{
+	uint32_t polls, busy_cycles;
+} TRfidReadyStats;
+
+static TRfidAsync g_rfid;
+static TRfidStats g_rfid_stats;
+static uint8_t g_rfid_errors;
+static TRfidReadyMode g_rfid_ready_mode = RFID_READY_DEFAULT;
+static TRfidReadyStats g_rfid_ready_stats;
+
+#ifdef  ENABLE_PN532_HISTOGRAM
+/* log2 latency histograms per PN532 command code */
+typedef struct
+{
+	uint8_t used, code;
+	uint16_t count[RFID_PHASES][RFID_HIST_BUCKETS];
+} TRfidHistogram;
+
+static TRfidHistogram g_rfid_hist[RFID_HIST_COMMANDS];
+static uint16_t g_rfid_hist_dropped;
+static const char *const g_rfid_phase_name[RFID_PHASES] =
+	{ "encode", "write", "ack", "response", "read" };
+#endif /*ENABLE_PN532_HISTOGRAM */
+
+/* RF timing profile: RFConfiguration frames for various timings
+   (CfgItem 0x02), MaxRtyCOM (0x04) and MaxRetries (0x05) */
+typedef struct
+{
+	const char *name;
+	unsigned char timings[RFID_FRAME_SIZE (5)];
+	unsigned char com[RFID_FRAME_SIZE (3)];
+	unsigned char retries[RFID_FRAME_SIZE (5)];
+} TRfidProfile;
+
+/* timeouts are encoded as 100us*2^(n-1) - 0x08 = 12.8ms, 0x0A = 51.2ms,
+   0x0B = 102.4ms, retry counts of 0xFF mean forever */
+static const TRfidProfile g_rfid_profile[RFID_PROFILES] = {
+	/* RFID_PROFILE_FAST_POLL: single activation attempt, an empty poll
+	   returns after a few milliseconds */
+	{
+	 "fast-poll",
+	 RFID_FRAME (5, PN532_CMD_RFConfiguration, 0x02, 0x00, 0x0B, 0x08),
+	 RFID_FRAME (3, PN532_CMD_RFConfiguration, 0x04, 0x00),
+	 RFID_FRAME (5, PN532_CMD_RFConfiguration, 0x05, 0x02, 0x01, 0x01)},
+	/* RFID_PROFILE_ROBUST: default timeouts, bounded retries */
+	{
+	 "robust",
+	 RFID_FRAME (5, PN532_CMD_RFConfiguration, 0x02, 0x00, 0x0B, 0x0A),
+	 RFID_FRAME (3, PN532_CMD_RFConfiguration, 0x04, 0x02),
+	 RFID_FRAME (5, PN532_CMD_RFConfiguration, 0x05, 0x02, 0x01, 0x10)},
+	/* RFID_PROFILE_EMULATION: PN532 power-on defaults */
+	{
+	 "emulation",
+	 RFID_FRAME (5, PN532_CMD_RFConfiguration, 0x02, 0x00, 0x0B, 0x0A),
+	 RFID_FRAME (3, PN532_CMD_RFConfiguration, 0x04, 0x00),
+	 RFID_FRAME (5, PN532_CMD_RFConfiguration, 0x05, 0xFF, 0x01, 0xFF)},
+};
+
+static int g_rfid_profile_id = -1;
+
+/* PN532 in PowerDown mode, woken up by RF level detector */
+static volatile BOOL g_rfid_asleep, g_rfid_woken;
+
+/* DWT cycle count of the last PN532 IRQ edge */
+static volatile uint32_t g_rfid_irq_cycles;
+
+/* CIU TxMode, RxMode and BitFraming saved while raw transceive is active */
+static const unsigned short g_rfid_raw_regs[] =
+	{ PN532_CIU_TxMode, PN532_CIU_RxMode, PN532_CIU_BitFraming };
+static unsigned char g_rfid_raw_saved[3];
+static BOOL g_rfid_raw_active;
+static uint8_t g_rfid_raw_bits;
+/* WriteRegister frame queued to restore the saved setup */
+static unsigned char g_rfid_raw_restore[1 + (3 * 3)];
+
+/* command code of the last synchronous write */
+static unsigned char g_rfid_code;
+
+/* SSP prescaler steps tried during calibration, slowest first - the
+   last one stays below the 5MHz PN532 SPI maximum at 72MHz SSP clock */
+static const uint8_t g_rfid_cpsdvsr[] = { 64, 48, 32, 24, 16 };
+
+/* PN532 chip select with currently calibrated SPI clock */
+static spi_cs g_rfid_cs = SPI_CS_PN532;
+static TRfidCommand g_rfid_queue[RFID_QUEUE_SIZE];
+static volatile uint8_t g_rfid_queue_head, g_rfid_queue_tail,
+	g_rfid_queue_count;
+static volatile uint8_t g_rfid_lock;
+/* set while rfid_poll runs a completion callback */
+static volatile BOOL g_rfid_in_callback;
+
+/* pre-encoded frames of frequently used constant commands */
+const unsigned char rfid_frame_get_firmware_version[RFID_FRAME_SIZE (1)] =
+	RFID_FRAME (1, PN532_CMD_GetFirmwareVersion);
+const unsigned char rfid_frame_sam_configuration[RFID_FRAME_SIZE (2)] =
+	RFID_FRAME (2, PN532_CMD_SAMConfiguration, 0x01 /* Normal Mode */ );
+const unsigned char rfid_frame_in_list_passive_target[RFID_FRAME_SIZE (3)] =
+	RFID_FRAME (3, PN532_CMD_InListPassiveTarget, 0x01 /* MaxTg */ ,
+				0x00 /* BrTy 106 kbps type A */ );
+const unsigned char rfid_frame_rf_field_off[RFID_FRAME_SIZE (3)] =
+	RFID_FRAME (3, PN532_CMD_RFConfiguration, 0x01 /* CfgItem */ ,
+				0x00 /* RF field off */ );
+
 void
 rfid_reset (unsigned char reset)
 {
@@ -36,45 +181,268 @@ rfid_reset (unsigned char reset)
 static void
 rfid_cs (unsigned char cs)
 {
-	GPIOSetValue (PN532_CS_PORT, PN532_CS_PIN, cs ? 1 : 0);
-	/* wait for chip to come up */
-	pmu_wait_ms (1);
+	if (cs)
+		spi_txrx_done (g_rfid_cs);
+	else
+		/* program SSP once per frame and wait for chip to come up */
+		spi_txrx_begin (g_rfid_cs);
 }
 
 static void
-rfid_tx (unsigned char data)
+rfid_tx_block (const void *data, int len)
 {
-	spi_txrx ((SPI_CS_PN532 ^ SPI_CS_MODE_SKIP_TX) |
-			  SPI_CS_MODE_SKIP_CS_ASSERT |
-			  SPI_CS_MODE_SKIP_CS_DEASSERT, &data, sizeof (data), NULL, 0);
+	spi_txrx_burst (g_rfid_cs, data, NULL, len);
 }
 
 static unsigned char
 rfid_rx (void)
 {
 	unsigned char data;
-	spi_txrx ((SPI_CS_PN532 ^ SPI_CS_MODE_SKIP_TX) |
-			  SPI_CS_MODE_SKIP_CS_ASSERT |
-			  SPI_CS_MODE_SKIP_CS_DEASSERT, NULL, 0, &data, sizeof (data));
 
+	spi_txrx_burst (g_rfid_cs, NULL, &data, sizeof (data));
 
 	return data;
 }
 
+static unsigned char
+rfid_rx_block (unsigned char *data, int len, unsigned char crc)
+{
+	int count;
+	unsigned char *p, scratch[16];
+
+	while (len > 0)
+	{
+		/* stream payload into caller buffer, or discard it in chunks */
+		if (data)
+			count = len;
+		else
+			count =
+				(len > (int) sizeof (scratch)) ? (int) sizeof (scratch) : len;
+
+		p = data ? data : scratch;
+		spi_txrx_burst (g_rfid_cs, NULL, p, count);
+
+		len -= count;
+		if (data)
+			data += count;
+
+		/* maintain crc */
+		while (count--)
+		{
+			debug (" %02X", *p);
+			crc += *p++;
+		}
+	}
+
+	return crc;
+}
+
+static void
+rfid_hist_mark (unsigned char code, TRfidPhase phase, uint32_t * mark)
+{
+#ifdef  ENABLE_PN532_HISTOGRAM
+	int i, bucket;
+	uint32_t now, cycles;
+	TRfidHistogram *h;
+
+	now = DWT_CYCCNT;
+	cycles = now - *mark;
+	*mark = now;
+
+	/* find or allocate slot for this command code */
+	h = NULL;
+	for (i = 0; i < RFID_HIST_COMMANDS; i++)
+		if (!g_rfid_hist[i].used || (g_rfid_hist[i].code == code))
+		{
+			h = &g_rfid_hist[i];
+			break;
+		}
+	if (!h)
+	{
+		g_rfid_hist_dropped++;
+		return;
+	}
+	h->used = TRUE;
+	h->code = code;
+
+	/* bucket n counts durations of 2^(n+RFID_HIST_SHIFT) cycles and up */
+	bucket = cycles ? (31 - __builtin_clz (cycles)) - RFID_HIST_SHIFT : 0;
+	if (bucket < 0)
+		bucket = 0;
+	else if (bucket >= RFID_HIST_BUCKETS)
+		bucket = RFID_HIST_BUCKETS - 1;
+
+	if (h->count[phase][bucket] < 0xFFFF)
+		h->count[phase][bucket]++;
+#else
+	(void) code;
+	(void) phase;
+	(void) mark;
+#endif /*ENABLE_PN532_HISTOGRAM */
+}
+
+static BOOL
+rfid_status_ready (void)
+{
+	unsigned char status;
+	uint32_t start;
+	static const unsigned char cmd = 0x02;								/* SPI status read */
+
+	start = DWT_CYCCNT;
+
+	rfid_cs (0);
+	rfid_tx_block (&cmd, sizeof (cmd));
+	status = rfid_rx ();
+	rfid_cs (1);
+
+	g_rfid_ready_stats.polls++;
+	g_rfid_ready_stats.busy_cycles += DWT_CYCCNT - start;
+
+	/* bit 0 signals a pending response */
+	return (status & 0x01) ? TRUE : FALSE;
+}
+
+BOOL
+rfid_ready (void)
+{
+	if (g_rfid_ready_mode == RFID_READY_SPI_STATUS)
+		return rfid_status_ready ();
+	else
+		return GPIOGetValue (PN532_IRQ_PORT, PN532_IRQ_PIN) ? FALSE : TRUE;
+}
+
+static void
+rfid_backoff (uint16_t delay_us)
+{
+	uint32_t start;
+
+	if (delay_us < RFID_STATUS_SLEEP_US)
+	{
+		/* below timer resolution - spin */
+		start = DWT_CYCCNT;
+		pmu_wait_us (delay_us);
+		g_rfid_ready_stats.busy_cycles += DWT_CYCCNT - start;
+		return;
+	}
+
+	/* sleep till timer expires, other interrupts may wake us earlier */
+	pmu_timeout_start (delay_us);
+	__disable_irq ();
+	while (!pmu_timeout_expired ())
+	{
+		__WFI ();
+		__enable_irq ();
+		__disable_irq ();
+	}
+	__enable_irq ();
+	pmu_timeout_stop ();
+}
+
 int
-rfid_read (void *data, unsigned char size)
+rfid_wait_ready (uint32_t timeout_us)
 {
 	int res;
-	unsigned char *p, c, pkt_size, crc, prev, t;
+	uint16_t delay_us;
+	uint32_t start, cycles;
 
-	/* wait 100ms max till PN532 response is ready */
-	t = 0;
+	/* response already pending */
+	if (rfid_ready ())
+		return 0;
+
+	if (g_rfid_ready_mode == RFID_READY_SPI_STATUS)
+	{
+		/* poll status byte with exponential backoff */
+		start = DWT_CYCCNT;
+		cycles = timeout_us * (SystemCoreClock / 1000000);
+		delay_us = RFID_STATUS_BACKOFF_MIN_US;
+
+		do
+		{
+			if ((DWT_CYCCNT - start) >= cycles)
+				return -8;
+
+			rfid_backoff (delay_us);
+			if (delay_us < RFID_STATUS_BACKOFF_MAX_US)
+				delay_us <<= 1;
+		}
+		while (!rfid_status_ready ());
+
+		return 0;
+	}
+
+	pmu_timeout_start (timeout_us);
+
+	/* check and sleep with IRQs masked to not miss the wakeup edge */
+	res = 0;
+	__disable_irq ();
 	while (GPIOGetValue (PN532_IRQ_PORT, PN532_IRQ_PIN))
 	{
-		if (t++ > 10)
-			return -8;
-		pmu_wait_ms (10);
+		if (pmu_timeout_expired ())
+		{
+			res = -8;
+			break;
+		}
+		__WFI ();
+		/* let pending IRQs run */
+		__enable_irq ();
+		__disable_irq ();
+	}
+	__enable_irq ();
+
+	pmu_timeout_stop ();
+
+	return res;
+}
+
+void
+rfid_set_ready_mode (TRfidReadyMode mode)
+{
+	g_rfid_ready_mode = mode;
+
+	/* PN532 IRQ line might be unrouted and floating */
+	LPC_GPIO[PN532_IRQ_PORT]->IC = 1 << PN532_IRQ_PIN;
+	if (mode == RFID_READY_IRQ)
+		NVIC_EnableIRQ (PN532_IRQ_IRQn);
+	else
+		NVIC_DisableIRQ (PN532_IRQ_IRQn);
+}
+
+static void
+rfid_set_step (uint8_t step)
+{
+	g_rfid_stats.step = step;
+	g_rfid_stats.cpsdvsr = g_rfid_cpsdvsr[step];
+	g_rfid_stats.spi_hz = SystemCoreClock /
+		(LPC_SYSCON->SSPCLKDIV * g_rfid_stats.cpsdvsr);
+	g_rfid_cs = SPI_CS_SET_CPSDVSR (g_rfid_cs, g_rfid_stats.cpsdvsr);
+	g_rfid_errors = 0;
+}
+
+static void
+rfid_link_check (int res)
+{
+	/* LCS or DCS errors hint at a too fast SPI clock */
+	if ((res == -4) || (res == -7))
+	{
+		g_rfid_stats.crc_errors++;
+		if ((++g_rfid_errors >= RFID_SPI_FALLBACK_ERRORS)
+			&& g_rfid_stats.step)
+		{
+			g_rfid_stats.fallbacks++;
+			rfid_set_step (g_rfid_stats.step - 1);
+		}
 	}
+	else if (res >= 0)
+		g_rfid_errors = 0;
+}
+
+static int
+rfid_read_frame (void *data, uint16_t size)
+{
+	int res;
+	BOOL extended;
+	uint16_t pkt_size;
+	unsigned char c, lcs, crc, prev, t, hdr[3];
 
 	debug ("RI: ");
 
@@ -82,7 +450,8 @@ rfid_read (void *data, unsigned char size)
 	rfid_cs (0);
 
 	/* read from FIFO command */
-	rfid_tx (0x03);
+	c = 0x03;
+	rfid_tx_block (&c, sizeof (c));
 
 	/* default result */
 	res = -9;
@@ -101,14 +470,27 @@ rfid_read (void *data, unsigned char size)
 		res = -3;
 	else
 	{
-		/* read packet size */
-		pkt_size = rfid_rx ();
+		/* read packet size and LCS in one go */
+		spi_txrx_burst (g_rfid_cs, NULL, hdr, 2);
+
+		/* extended information frame: 0xFF 0xFF LENM LENL LCS */
+		if ((extended = ((hdr[0] == 0xFF) && (hdr[1] == 0xFF))) == TRUE)
+		{
+			spi_txrx_burst (g_rfid_cs, NULL, hdr, 3);
+			pkt_size = (((uint16_t) hdr[0]) << 8) | hdr[1];
+			lcs = hdr[0] + hdr[1] + hdr[2];
+		}
+		else
+		{
+			pkt_size = hdr[0];
+			lcs = hdr[0] + hdr[1];
+		}
 
 		/* special treatment for NACK and ACK */
-		if ((pkt_size == 0x00) || (pkt_size == 0xFF))
+		if (!extended && ((pkt_size == 0x00) || (pkt_size == 0xFF)))
 		{
 			/* verify if second length byte is inverted */
-			if (rfid_rx () != (unsigned char) (~pkt_size))
+			if (hdr[1] != (unsigned char) (~pkt_size))
 				res = -2;
 			else
 			{
@@ -121,7 +503,7 @@ rfid_read (void *data, unsigned char size)
 		else
 		{
 			/* verify packet size against LCS */
-			if (((pkt_size + rfid_rx ()) & 0xFF) != 0)
+			if (lcs || !pkt_size)
 				res = -4;
 			else
 			{
@@ -139,22 +521,9 @@ rfid_read (void *data, unsigned char size)
 						res = -6;
 					else
 					{
-						/* read packet */
-						p = (unsigned char *) data;
-						while (pkt_size--)
-						{
-							/* read data */
-							c = rfid_rx ();
-							debug (" %02X", c);
-
-							/* maintain crc */
-							crc += c;
-							/* save payload */
-							if (p)
-								*p++ = c;
-						}
-
-						/* add DCS to CRC */
+						/* stream packet, then add DCS to CRC */
+						crc = rfid_rx_block ((unsigned char *) data,
+											 pkt_size, crc);
 						crc += rfid_rx ();
 						/* verify CRC */
 						if (crc)
@@ -175,138 +544,1516 @@ rfid_read (void *data, unsigned char size)
 
 	debug (" [%i]\n", res);
 
+	rfid_link_check (res);
+
 	/* everything fine */
 	return res;
 }
 
-int
-rfid_write (const void *data, int len)
+static int
+rfid_frame_encode (TRfidFrame * frame, const void *data, int len)
 {
 	int i;
-	static const unsigned char preamble[] = { 0x01, 0x00, 0x00, 0xFF };
-	const unsigned char *p = preamble;
-	unsigned char tfi = 0xD4, c;
+	const unsigned char *p;
+	unsigned char crc;
 
 	if (!data)
 		len = 0xFF;
 
+	frame->hdr[0] = 0x01;														/* SPI data write */
+	frame->hdr[1] = 0x00;														/* Praeamble */
+	frame->hdr[2] = 0x00;
+	frame->hdr[3] = 0xFF;
+	if ((len + 1) > 0xFF)
+	{
+		/* extended information frame */
+		frame->hdr[4] = 0xFF;
+		frame->hdr[5] = 0xFF;
+		frame->hdr[6] = (len + 1) >> 8;											/* LENM */
+		frame->hdr[7] = (len + 1) & 0xFF;										/* LENL */
+		frame->hdr[8] = 0x100 - ((frame->hdr[6] + frame->hdr[7]) & 0xFF);		/* LCS */
+		frame->hdr_len = 10;
+	}
+	else
+	{
+		frame->hdr[4] = len + 1;												/* LEN */
+		frame->hdr[5] = 0x100 - (len + 1);										/* LCS */
+		frame->hdr_len = 7;
+	}
+	frame->hdr[frame->hdr_len - 1] = crc = 0xD4;								/* TFI */
+
+	/* calculate DCS upfront so the frame streams without gaps */
+	p = (const unsigned char *) data;
+	if (p)
+		for (i = 0; i < len; i++)
+			crc += p[i];
+	frame->trailer[0] = 0x100 - crc;											/* DCS */
+	frame->trailer[1] = 0x00;													/* Postamble */
+
+	return len;
+}
+
+static void
+rfid_frame_send (const TRfidFrame * frame, const void *data, int len)
+{
+#ifdef  DEBUG
+	int i;
+
 	debug ("TI: ");
+	if (data)
+		for (i = 0; i < len; i++)
+			debug (" %02X", ((const unsigned char *) data)[i]);
+	debug ("\n");
+#endif /*DEBUG*/
 
 	/* enable chip select */
 	rfid_cs (0);
 
-	p = preamble;																/* Praeamble */
-	for (i = 0; i < (int) sizeof (preamble); i++)
-		rfid_tx (*p++);
-	rfid_tx (len + 1);															/* LEN */
-	rfid_tx (0x100 - (len + 1));												/* LCS */
-	rfid_tx (tfi);																/* TFI */
-	/* PDn */
-	p = (const unsigned char *) data;
-	while (len--)
-	{
-		c = *p++;
-		debug (" %02X", c);
+	rfid_tx_block (frame->hdr, frame->hdr_len);
+	rfid_tx_block (data, len);													/* PDn */
+	rfid_tx_block (frame->trailer, sizeof (frame->trailer));
+
+	/* release chip select */
+	rfid_cs (1);
+}
 
-		rfid_tx (c);
-		tfi += c;
+static void
+rfid_transmit (const TRfidFrame * frame, const void *data, int len)
+{
+	if (frame)
+		rfid_frame_send (frame, data, len);
+	else
+	{
+		/* pre-encoded wire frame */
+		rfid_cs (0);
+		rfid_tx_block (data, len);
+		rfid_cs (1);
 	}
-	rfid_tx (0x100 - tfi);														/* DCS */
-	rfid_rx ();																	/* Postamble */
+}
 
-	/* release chip select */
+static void
+rfid_send_control (BOOL nack)
+{
+	/* ACK aborts the current command, NACK requests the last response */
+	static const unsigned char ack[] =
+		{ 0x01, 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+	static const unsigned char nak[] =
+		{ 0x01, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00 };
+
+	rfid_cs (0);
+	rfid_tx_block (nack ? nak : ack, sizeof (ack));
 	rfid_cs (1);
+}
 
-	debug ("\n");
+static void
+rfid_link_flush (void)
+{
+	static const unsigned char cmd = 0x01;								/* SPI data write */
+
+	g_rfid_stats.flushes++;
+
+	/* zeros terminate any partial frame in the PN532 input FIFO */
+	rfid_cs (0);
+	rfid_tx_block (&cmd, sizeof (cmd));
+	rfid_tx_block (NULL, PN532_FIFO_SIZE);
+	rfid_cs (1);
 
-	/* check for ack */
-	return rfid_read (NULL, 0);
+	/* abort running command, drop pending output */
+	rfid_send_control (FALSE);
+	if (rfid_ready ())
+		rfid_read_frame (NULL, 0);
 }
 
-int
-rfid_execute (void *data, unsigned int isize, unsigned int osize)
+/* ACK/response timeout limited to what is left of a cycle budget */
+static uint32_t
+rfid_link_timeout (uint32_t start, uint32_t budget)
 {
-	int res;
+	uint32_t elapsed, left_us;
 
-	if ((res = rfid_write (data, isize)) < 0)
-		return res;
-	else
-		return rfid_read (data, osize);
+	elapsed = DWT_CYCCNT - start;
+	if (elapsed >= budget)
+		return 0;
+
+	left_us = (budget - elapsed) / (SystemCoreClock / 1000000);
+	return (left_us < RFID_ACK_TIMEOUT_US) ? left_us : RFID_ACK_TIMEOUT_US;
 }
 
-int
-rfid_write_register (unsigned short address, unsigned char data)
+static BOOL
+rfid_link_command (const unsigned char *frame, int size, uint32_t start,
+				   uint32_t budget)
 {
-	unsigned char cmd[4];
+	unsigned char data[4];
 
-	/* write register */
-	cmd[0] = PN532_CMD_WriteRegister;
-	/* high byte of address */
-	cmd[1] = address >> 8;
-	/* low byte of address */
-	cmd[2] = address & 0xFF;
-	/* data value */
-	cmd[3] = data;
+	/* bare pre-encoded command without recovery */
+	if (!rfid_link_timeout (start, budget))
+		return FALSE;
+	rfid_transmit (NULL, frame, size);
+	return (rfid_wait_ready (rfid_link_timeout (start, budget)) == 0)
+		&& (rfid_read_frame (NULL, 0) == 0)
+		&& (rfid_wait_ready (rfid_link_timeout (start, budget)) == 0)
+		&& (rfid_read_frame (data, sizeof (data)) >= 0);
+}
 
-	return rfid_execute (&cmd, sizeof (cmd), sizeof (data));
+static void
+rfid_link_reset (uint32_t start, uint32_t budget)
+{
+	const TRfidProfile *p;
+
+	g_rfid_stats.resets++;
+	g_rfid_asleep = FALSE;
+	/* reset brings CIU TxMode, RxMode and BitFraming back to defaults */
+	g_rfid_raw_active = FALSE;
+
+	rfid_reset (0);
+	pmu_wait_us (RFID_RESET_PULSE_US);
+	rfid_reset (1);
+
+	/* poll till PN532 acknowledges leaving LowVbat mode instead of
+	   waiting out the full boot time, stop once the budget is gone */
+	do
+	{
+		/* hold chip select to wake up SPI interface */
+		rfid_cs (0);
+		pmu_wait_us (RFID_WAKEUP_US);
+		rfid_cs (1);
+
+		if (rfid_link_command (rfid_frame_sam_configuration,
+							   sizeof (rfid_frame_sam_configuration),
+							   start, budget))
+			break;
+	}
+	while (rfid_link_timeout (start, budget));
+
+	/* restore RF timing profile, forget it if out of time */
+	if (g_rfid_profile_id >= 0)
+	{
+		p = &g_rfid_profile[g_rfid_profile_id];
+		if (!rfid_link_command (p->timings, sizeof (p->timings), start,
+								budget)
+			|| !rfid_link_command (p->com, sizeof (p->com), start, budget)
+			|| !rfid_link_command (p->retries, sizeof (p->retries), start,
+								   budget))
+			g_rfid_profile_id = -1;
+	}
 }
 
-int
-rfid_read_register (unsigned short address)
+static int
+rfid_link_write (const TRfidFrame * frame, const void *data, int len,
+				 uint32_t * mark)
 {
-	int res;
-	unsigned char cmd[3];
+	int res, retries;
+	uint8_t level;
+	uint32_t start, budget;
 
-	/* write register */
-	cmd[0] = PN532_CMD_ReadRegister;
-	/* high byte of address */
-	cmd[1] = address >> 8;
-	/* low byte of address */
-	cmd[2] = address & 0xFF;
+	start = DWT_CYCCNT;
+	budget = RFID_LINK_BUDGET_US * (SystemCoreClock / 1000000);
+	retries = level = 0;
 
-	if ((res = rfid_execute (&cmd, sizeof (cmd), sizeof (cmd))) > 1)
-		return cmd[1];
-	else
-		return res;
+	while (TRUE)
+	{
+		rfid_transmit (frame, data, len);
+		if (!level && !retries)
+			rfid_hist_mark (g_rfid_code, RFID_PHASE_WRITE, mark);
+
+		/* check for ack */
+		if ((res = rfid_wait_ready (RFID_ACK_TIMEOUT_US)) == 0)
+			if ((res = rfid_read_frame (NULL, 0)) == 0)
+				return 0;
+
+		if (res == -8)
+			g_rfid_stats.ack_timeouts++;
+
+		if ((DWT_CYCCNT - start) >= budget)
+			break;
+
+		/* NACK: PN532 saw a broken frame, simply retransmit */
+		if ((res == -1) && (retries++ < RFID_LINK_RETRIES))
+		{
+			g_rfid_stats.retransmits++;
+			continue;
+		}
+
+		/* escalate: resync FIFO, then reset PN532 */
+		retries = 0;
+		switch (level++)
+		{
+			case 0:
+				rfid_link_flush ();
+				break;
+			case 1:
+				rfid_link_reset (start, budget);
+				break;
+			default:
+				return res;
+		}
+	}
+
+	return res;
 }
 
-int
-rfid_mask_register (unsigned short address, unsigned char data,
-					unsigned char mask)
+static BOOL
+rfid_link_garbled (int res)
 {
-	int res;
+	/* preamble, LCS, TFI or DCS broken on the wire */
+	return (res == -3) || (res == -4) || (res == -6) || (res == -7);
+}
 
-	if ((res = rfid_read_register (address)) < 0)
-		return res;
-	else
-		return rfid_write_register (address,
-									(((unsigned char) res) & (~mask)) | (data
-																		 &
-																		 mask));
+static int
+rfid_link_read (void *data, uint16_t size)
+{
+	int res, retries;
+
+	for (retries = 0;; retries++)
+	{
+		res = rfid_read_frame (data, size);
+
+		/* ask PN532 to resend a response garbled on the wire */
+		if (!rfid_link_garbled (res) || (retries >= RFID_LINK_RETRIES))
+			break;
+
+		g_rfid_stats.resends++;
+		rfid_send_control (TRUE);
+		if ((res = rfid_wait_ready (RFID_ACK_TIMEOUT_US)) < 0)
+			break;
+	}
+
+	return res;
 }
 
 void
-rfid_init (void)
+rfid_wake_up (void)
 {
-	/* Initialize RESET line */
-	GPIOSetDir (PN532_RESET_PORT, PN532_RESET_PIN, 1);
+	if (!g_rfid_asleep)
+		return;
+	g_rfid_asleep = FALSE;
 
-	/* reset PN532 */
-	GPIOSetValue (PN532_RESET_PORT, PN532_RESET_PIN, 0);
+	/* chip select activity wakes up the SPI interface */
+	rfid_cs (0);
+	pmu_wait_us (RFID_WAKEUP_US);
+	rfid_cs (1);
 
-	/* initialize PN532 IRQ line */
-	GPIOSetDir (PN532_IRQ_PORT, PN532_IRQ_PIN, 0);
+	/* drop wakeup IRQ indication */
+	if (g_rfid_woken && rfid_ready ())
+		rfid_read_frame (NULL, 0);
+	g_rfid_woken = FALSE;
+}
+
+void
+rfid_recover (void)
+{
+	uint8_t lock;
+
+	lock = g_rfid_lock;
+	g_rfid_lock = TRUE;
+
+	rfid_link_flush ();
+	rfid_link_reset (DWT_CYCCNT,
+					 RFID_RESET_BOOT_US * (SystemCoreClock / 1000000));
+
+	g_rfid_lock = lock;
+}
+
+static BOOL
+rfid_queue_pop (TRfidCommand * cmd)
+{
+	BOOL res;
+
+	__disable_irq ();
+	if ((res = (g_rfid_queue_count > 0)) == TRUE)
+	{
+		*cmd = g_rfid_queue[g_rfid_queue_tail];
+		g_rfid_queue_tail = (g_rfid_queue_tail + 1) % RFID_QUEUE_SIZE;
+		g_rfid_queue_count--;
+	}
+	__enable_irq ();
+
+	return res;
+}
+
+static void
+rfid_async_deadline (uint32_t timeout_us)
+{
+	g_rfid.backoff_us = RFID_STATUS_BACKOFF_MIN_US;
+	g_rfid.start = DWT_CYCCNT;
+	g_rfid.cycles = timeout_us * (SystemCoreClock / 1000000);
+}
+
+static BOOL
+rfid_async_expired (void)
+{
+	return (DWT_CYCCNT - g_rfid.start) >= g_rfid.cycles;
+}
+
+static void
+rfid_frame_written (int res, void *context)
+{
+	(void) res;
+	(void) context;
+
+	/* runs from SSP IRQ: chain header, payload and trailer */
+	switch (++g_rfid.segment)
+	{
+		case 1:
+			if (g_rfid.cmd.isize)
+			{
+				spi_txrx_async (g_rfid_cs | SPI_CS_MODE_SKIP_CS,
+								g_rfid.cmd.data, g_rfid.cmd.isize, NULL, 0,
+								rfid_frame_written, NULL);
+				break;
+			}
+			g_rfid.segment++;
+			/* intentionally no 'break;' */
+
+		case 2:
+			spi_txrx_async (g_rfid_cs | SPI_CS_MODE_SKIP_CS_ASSERT,
+							g_rfid.cmd.frame.trailer,
+							sizeof (g_rfid.cmd.frame.trailer), NULL, 0,
+							rfid_frame_written, NULL);
+			break;
+
+		default:
+			rfid_hist_mark (g_rfid.cmd.code, RFID_PHASE_WRITE, &g_rfid.mark);
+			rfid_async_deadline (RFID_ACK_TIMEOUT_US);
+			g_rfid.state = RFID_STATE_ACK;
+			rfid_poll ();
+	}
+}
+
+int
+rfid_poll (void)
+{
+	int res;
+	BOOL progress;
+	void *data, *context;
+	TRfidCallback callback;
+
+	/* never re-enter from PN532 IRQ while the main loop is polling */
+	if (g_rfid_lock)
+		return g_rfid.state;
+	g_rfid_lock = TRUE;
+
+	do
+	{
+		progress = FALSE;
+
+		switch (g_rfid.state)
+		{
+			case RFID_STATE_SEND:
+				/* frame was encoded when the command got queued, stream
+				   it from SSP interrupts - retry later if SSP is busy */
+				rfid_wake_up ();
+				g_rfid.mark = DWT_CYCCNT;
+				g_rfid.state = RFID_STATE_WRITE;
+				if (g_rfid.cmd.wire)
+				{
+					/* constant frame goes out in a single burst */
+					g_rfid.segment = 2;
+					res = spi_txrx_async (g_rfid_cs, g_rfid.cmd.wire,
+										  g_rfid.cmd.wire_size, NULL, 0,
+										  rfid_frame_written, NULL);
+				}
+				else
+				{
+					g_rfid.segment = 0;
+					res = spi_txrx_async (g_rfid_cs |
+										  SPI_CS_MODE_SKIP_CS_DEASSERT,
+										  g_rfid.cmd.frame.hdr,
+										  g_rfid.cmd.frame.hdr_len, NULL, 0,
+										  rfid_frame_written, NULL);
+				}
+				if (res < 0)
+					g_rfid.state = RFID_STATE_SEND;
+				break;
+
+			case RFID_STATE_ACK:
+			case RFID_STATE_RESPONSE:
+				/* PN532 still busy */
+				if (!rfid_ready ())
+				{
+					if (!rfid_async_expired ())
+						break;
+
+					if ((g_rfid.state == RFID_STATE_ACK)
+						&& (g_rfid.retries++ < RFID_LINK_RETRIES))
+					{
+						/* no ACK - resync FIFO and retransmit */
+						g_rfid_stats.ack_timeouts++;
+						rfid_link_flush ();
+						g_rfid.state = RFID_STATE_SEND;
+						progress = TRUE;
+					}
+					else
+					{
+						g_rfid.res = -8;
+						g_rfid.state = RFID_STATE_ERROR;
+					}
+					break;
+				}
+
+				if (g_rfid.state == RFID_STATE_ACK)
+				{
+					res = rfid_read_frame (NULL, 0);
+					rfid_hist_mark (g_rfid.cmd.code, RFID_PHASE_ACK,
+									&g_rfid.mark);
+					if ((res == -1) && (g_rfid.retries++ < RFID_LINK_RETRIES))
+					{
+						/* NACK - PN532 saw a broken frame */
+						g_rfid_stats.retransmits++;
+						g_rfid.state = RFID_STATE_SEND;
+						progress = TRUE;
+					}
+					else if (res < 0)
+					{
+						g_rfid.res = res;
+						g_rfid.state = RFID_STATE_ERROR;
+					}
+					else
+					{
+						rfid_async_deadline (g_rfid.cmd.timeout_us);
+						g_rfid.state = RFID_STATE_RESPONSE;
+						progress = TRUE;
+					}
+				}
+				else
+				{
+					rfid_hist_mark (g_rfid.cmd.code, RFID_PHASE_RESPONSE,
+									&g_rfid.mark);
+					res = rfid_read_frame (g_rfid.cmd.data, g_rfid.cmd.osize);
+					rfid_hist_mark (g_rfid.cmd.code, RFID_PHASE_READ,
+									&g_rfid.mark);
+					if (rfid_link_garbled (res)
+						&& (g_rfid.retries++ < RFID_LINK_RETRIES))
+					{
+						/* NACK makes PN532 resend the response */
+						g_rfid_stats.resends++;
+						rfid_send_control (TRUE);
+						rfid_async_deadline (RFID_ACK_TIMEOUT_US);
+						break;
+					}
+					g_rfid.res = res;
+					g_rfid.state =
+						(res < 0) ? RFID_STATE_ERROR : RFID_STATE_DONE;
+				}
+				break;
+
+			default:
+				break;
+		}
+
+		/* report completion, callback may submit further commands */
+		if ((g_rfid.state == RFID_STATE_DONE)
+			|| (g_rfid.state == RFID_STATE_ERROR))
+		{
+			res = g_rfid.res;
+			data = g_rfid.cmd.data;
+			context = g_rfid.cmd.context;
+			callback = g_rfid.cmd.callback;
+
+			g_rfid.state = RFID_STATE_IDLE;
+			if (callback)
+			{
+				g_rfid_in_callback = TRUE;
+				callback (res, data, context);
+				g_rfid_in_callback = FALSE;
+			}
+		}
+
+		/* issue next pre-encoded command the moment we are idle */
+		if ((g_rfid.state == RFID_STATE_IDLE) && rfid_queue_pop (&g_rfid.cmd))
+		{
+			g_rfid.retries = 0;
+			g_rfid.state = RFID_STATE_SEND;
+			progress = TRUE;
+		}
+	}
+	while (progress);
+
+	g_rfid_lock = FALSE;
+
+	return g_rfid.state;
+}
+
+static BOOL
+rfid_raw_restore_needed (unsigned char code)
+{
+	/* register access and InCommunicateThru keep the raw setup */
+	return g_rfid_raw_active && (code != PN532_CMD_InCommunicateThru)
+		&& (code != PN532_CMD_ReadRegister)
+		&& (code != PN532_CMD_WriteRegister);
+}
+
+static int
+rfid_raw_leave (unsigned char code)
+{
+	int i, res;
+	TRfidRegister reg[3];
+
+	if (!rfid_raw_restore_needed (code))
+		return 0;
+
+	/* restore CRC and bit framing for PN532 firmware commands */
+	for (i = 0; i < 3; i++)
+	{
+		reg[i].address = g_rfid_raw_regs[i];
+		reg[i].data = g_rfid_raw_saved[i];
+	}
+	if ((res = rfid_write_registers (reg, 3)) < 0)
+		return res;
+
+	g_rfid_raw_active = FALSE;
+	return 0;
+}
+
+static void
+rfid_raw_restored (int res, void *data, void *context)
+{
+	(void) data;
+	(void) context;
+
+	/* retry with the next PN532 firmware command */
+	if (res < 0)
+		g_rfid_raw_active = TRUE;
+}
+
+static int
+rfid_raw_leave_async (unsigned char code)
+{
+	int i, res;
+
+	if (!rfid_raw_restore_needed (code))
+		return 0;
+
+	/* queue the restore ahead of the command instead of blocking,
+	   rfid_submit may run from a completion callback */
+	g_rfid_raw_restore[0] = PN532_CMD_WriteRegister;
+	for (i = 0; i < 3; i++)
+	{
+		g_rfid_raw_restore[1 + (i * 3)] = g_rfid_raw_regs[i] >> 8;
+		g_rfid_raw_restore[2 + (i * 3)] = g_rfid_raw_regs[i] & 0xFF;
+		g_rfid_raw_restore[3 + (i * 3)] = g_rfid_raw_saved[i];
+	}
+	if ((res = rfid_submit (g_rfid_raw_restore, sizeof (g_rfid_raw_restore),
+							sizeof (g_rfid_raw_restore), PN532_TIMEOUT_US,
+							rfid_raw_restored, NULL)) < 0)
+		return res;
+
+	g_rfid_raw_active = FALSE;
+	return 0;
+}
+
+static TRfidCommand *
+rfid_queue_push (void)
+{
+	TRfidCommand *cmd;
+
+	__disable_irq ();
+	if (g_rfid_queue_count >= RFID_QUEUE_SIZE)
+	{
+		__enable_irq ();
+		return NULL;
+	}
+	cmd = &g_rfid_queue[g_rfid_queue_head];
+	g_rfid_queue_head = (g_rfid_queue_head + 1) % RFID_QUEUE_SIZE;
+	g_rfid_queue_count++;
+	/* keep IRQ-driven rfid_poll from picking up the half-filled entry,
+	   we might be called from a completion callback with lock held */
+	g_rfid_lock = TRUE;
+	__enable_irq ();
+
+	return cmd;
+}
+
+int
+rfid_submit (void *data, unsigned int isize, unsigned int osize,
+			 uint32_t timeout_us, TRfidCallback callback, void *context)
+{
+	int res;
+	uint8_t lock;
+	uint32_t mark;
+	TRfidCommand *cmd;
+
+	if (isize > PN532_MAX_PAYLOAD_SIZE)
+		return -5;
+
+	if ((res = rfid_raw_leave_async (data ? *((unsigned char *) data) : 0))
+		< 0)
+		return res;
+
+	lock = g_rfid_lock;
+	if ((cmd = rfid_queue_push ()) == NULL)
+		return -10;
+
+	/* pre-encode frame while the current command is still in flight */
+	cmd->data = data;
+	cmd->osize = osize;
+	cmd->timeout_us = timeout_us;
+	cmd->callback = callback;
+	cmd->context = context;
+	cmd->wire = NULL;
+	cmd->code = data ? *((unsigned char *) data) : 0;
+	mark = DWT_CYCCNT;
+	cmd->isize = rfid_frame_encode (&cmd->frame, data, isize);
+	rfid_hist_mark (cmd->code, RFID_PHASE_ENCODE, &mark);
+
+	g_rfid_lock = lock;
+
+	/* transmit right away if PN532 is idle */
+	rfid_poll ();
+
+	return 0;
+}
+
+int
+rfid_submit_frame (const void *frame, unsigned int size, void *data,
+				   unsigned int osize, uint32_t timeout_us,
+				   TRfidCallback callback, void *context)
+{
+	int res;
+	uint8_t lock;
+	TRfidCommand *cmd;
+
+	if ((res = rfid_raw_leave_async (((const unsigned char *) frame)[7])) < 0)
+		return res;
+
+	lock = g_rfid_lock;
+	if ((cmd = rfid_queue_push ()) == NULL)
+		return -10;
+
+	/* frame is already encoded, response goes to data */
+	cmd->data = data;
+	cmd->isize = 0;
+	cmd->osize = osize;
+	cmd->timeout_us = timeout_us;
+	cmd->callback = callback;
+	cmd->context = context;
+	cmd->wire = (const unsigned char *) frame;
+	cmd->wire_size = size;
+	cmd->code = cmd->wire[7];
+
+	g_rfid_lock = lock;
+
+	rfid_poll ();
+
+	return 0;
+}
+
+int
+rfid_pending (void)
+{
+	return g_rfid_queue_count + ((g_rfid.state != RFID_STATE_IDLE) ? 1 : 0);
+}
+
+void
+rfid_abort (void)
+{
+	TRfidCommand cmd;
+	uint8_t lock, count;
+	BOOL busy, in_callback;
+
+	lock = g_rfid_lock;
+	g_rfid_lock = TRUE;
+
+	/* an ACK frame from the host aborts the current PN532 command */
+	if ((busy = (g_rfid.state != RFID_STATE_IDLE)) == TRUE)
+	{
+		rfid_send_control (FALSE);
+		g_rfid.state = RFID_STATE_IDLE;
+	}
+
+	/* fail the current and all queued commands, commands submitted
+	   from these callbacks stay queued */
+	in_callback = g_rfid_in_callback;
+	g_rfid_in_callback = TRUE;
+	if (busy && g_rfid.cmd.callback)
+		g_rfid.cmd.callback (-13, g_rfid.cmd.data, g_rfid.cmd.context);
+	for (count = g_rfid_queue_count; count && rfid_queue_pop (&cmd); count--)
+		if (cmd.callback)
+			cmd.callback (-13, cmd.data, cmd.context);
+	g_rfid_in_callback = in_callback;
+
+	g_rfid_lock = lock;
+}
+
+void
+rfid_idle (void)
+{
+	uint32_t elapsed;
+
+	if ((g_rfid_ready_mode == RFID_READY_SPI_STATUS)
+		&& ((g_rfid.state == RFID_STATE_ACK)
+			|| (g_rfid.state == RFID_STATE_RESPONSE)))
+	{
+		/* no IRQ line - back off till next status poll */
+		elapsed = (DWT_CYCCNT - g_rfid.start) / (SystemCoreClock / 1000000);
+		if (elapsed < (g_rfid.cycles / (SystemCoreClock / 1000000)))
+		{
+			elapsed = (g_rfid.cycles / (SystemCoreClock / 1000000)) - elapsed;
+			rfid_backoff ((elapsed < g_rfid.backoff_us) ?
+						  elapsed : g_rfid.backoff_us);
+			if (g_rfid.backoff_us < RFID_STATUS_BACKOFF_MAX_US)
+				g_rfid.backoff_us <<= 1;
+		}
+		return;
+	}
+
+	/* sleep till PN532 IRQ, any other interrupt or command deadline */
+	__disable_irq ();
+	if (g_rfid.state == RFID_STATE_WRITE)
+		/* SSP interrupt completes the frame */
+		__WFI ();
+	else if (((g_rfid.state == RFID_STATE_ACK)
+			  || (g_rfid.state == RFID_STATE_RESPONSE))
+			 && GPIOGetValue (PN532_IRQ_PORT, PN532_IRQ_PIN))
+	{
+		elapsed = DWT_CYCCNT - g_rfid.start;
+		if (elapsed < g_rfid.cycles)
+		{
+			pmu_timeout_start ((g_rfid.cycles - elapsed) /
+							   (SystemCoreClock / 1000000));
+			__WFI ();
+			pmu_timeout_stop ();
+		}
+	}
+	__enable_irq ();
+}
+
+void
+PN532_IRQ_HANDLER (PN532_IRQ_PORT) (void)
+{
+	g_rfid_irq_cycles = DWT_CYCCNT;
+
+	/* acknowledge falling edge */
+	LPC_GPIO[PN532_IRQ_PORT]->IC = 1 << PN532_IRQ_PIN;
+	__DSB ();
+
+	/* PN532 woke up from PowerDown on its own */
+	if (g_rfid_asleep)
+		g_rfid_woken = TRUE;
+
+	/* drive pending asynchronous command */
+	if ((g_rfid.state == RFID_STATE_ACK)
+		|| (g_rfid.state == RFID_STATE_RESPONSE))
+		rfid_poll ();
+}
+
+static int
+rfid_sync_begin (uint8_t * lock)
+{
+	/* rfid_poll can't advance the queue below a completion
+	   callback - waiting for it would never return */
+	if (g_rfid_in_callback)
+		return -10;
+
+	/* finish pending asynchronous commands first, nested calls
+	   already own the link */
+	*lock = g_rfid_lock;
+	if (!*lock)
+		while (rfid_pending ())
+		{
+			rfid_poll ();
+			rfid_idle ();
+		}
+
+	/* keep PN532 IRQ from interfering */
+	g_rfid_lock = TRUE;
+
+	rfid_wake_up ();
+
+	return 0;
+}
+
+static void
+rfid_sync_end (uint8_t lock)
+{
+	g_rfid_lock = lock;
+}
+
+int
+rfid_read_timeout (void *data, uint16_t size, uint32_t timeout_us)
+{
+	int res;
+	uint8_t lock;
+	uint32_t mark;
+
+	if ((res = rfid_sync_begin (&lock)) < 0)
+		return res;
+
+	/* wait till PN532 response is ready */
+	mark = DWT_CYCCNT;
+	if ((res = rfid_wait_ready (timeout_us)) == 0)
+	{
+		rfid_hist_mark (g_rfid_code, RFID_PHASE_RESPONSE, &mark);
+		res = rfid_link_read (data, size);
+		rfid_hist_mark (g_rfid_code, RFID_PHASE_READ, &mark);
+	}
+
+	rfid_sync_end (lock);
+
+	return res;
+}
+
+int
+rfid_read (void *data, uint16_t size)
+{
+	return rfid_read_timeout (data, size, PN532_TIMEOUT_US);
+}
+
+int
+rfid_write (const void *data, int len)
+{
+	int res;
+	uint8_t lock;
+	uint32_t mark;
+	TRfidFrame frame;
+
+	if (len > PN532_MAX_PAYLOAD_SIZE)
+		return -5;
+
+	if ((res = rfid_raw_leave (data ? *((const unsigned char *) data) : 0))
+		< 0)
+		return res;
+
+	if ((res = rfid_sync_begin (&lock)) < 0)
+		return res;
+
+	mark = DWT_CYCCNT;
+	g_rfid_code = data ? *((const unsigned char *) data) : 0;
+
+	len = rfid_frame_encode (&frame, data, len);
+	rfid_hist_mark (g_rfid_code, RFID_PHASE_ENCODE, &mark);
+
+	/* write and wait for ACK, recover link on failure */
+	res = rfid_link_write (&frame, data, len, &mark);
+	rfid_hist_mark (g_rfid_code, RFID_PHASE_ACK, &mark);
+
+	rfid_sync_end (lock);
+
+	return res;
+}
+
+int
+rfid_send_frame (const void *frame, unsigned int size)
+{
+	int res;
+	uint8_t lock;
+	uint32_t mark;
+
+	if ((res = rfid_raw_leave (((const unsigned char *) frame)[7])) < 0)
+		return res;
+
+	if ((res = rfid_sync_begin (&lock)) < 0)
+		return res;
+
+	/* transmit pre-encoded frame in one burst */
+	mark = DWT_CYCCNT;
+	g_rfid_code = ((const unsigned char *) frame)[7];
+	res = rfid_link_write (NULL, frame, size, &mark);
+	rfid_hist_mark (g_rfid_code, RFID_PHASE_ACK, &mark);
+
+	rfid_sync_end (lock);
+
+	return res;
+}
+
+int
+rfid_execute_frame (const void *frame, unsigned int size, void *data,
+					unsigned int osize)
+{
+	int res;
+
+	if ((res = rfid_send_frame (frame, size)) < 0)
+		return res;
+	else
+		return rfid_read (data, osize);
+}
+
+int
+rfid_execute_timeout (void *data, unsigned int isize, unsigned int osize,
+					  uint32_t timeout_us)
+{
+	int res;
+
+	if ((res = rfid_write (data, isize)) < 0)
+		return res;
+	else
+		return rfid_read_timeout (data, osize, timeout_us);
+}
+
+int
+rfid_execute (void *data, unsigned int isize, unsigned int osize)
+{
+	return rfid_execute_timeout (data, isize, osize, PN532_TIMEOUT_US);
+}
+
+int
+rfid_power_down (unsigned char wakeup)
+{
+	int res;
+	unsigned char cmd[3];
+
+	cmd[0] = PN532_CMD_PowerDown;
+	cmd[1] = wakeup;
+	/* pull IRQ line on wakeup */
+	cmd[2] = 0x01;
+
+	/* PN532 sleeps right after its response got read */
+	if ((res = rfid_execute (&cmd, sizeof (cmd), sizeof (cmd))) < 2)
+		return (res < 0) ? res : -1;
+	if (cmd[1])
+		return -cmd[1];
+
+	g_rfid_woken = FALSE;
+	g_rfid_asleep = TRUE;
+
+	return 0;
+}
+
+int
+rfid_sleep (uint32_t timeout_us)
+{
+	int res;
+	unsigned char wakeup;
+
+	/* field goes off, RF level detector and SPI stay armed - without
+	   IRQ line nobody hears the detector, so only sleep out the time */
+	wakeup = PN532_WAKEUP_SPI;
+	if (g_rfid_ready_mode == RFID_READY_IRQ)
+		wakeup |= PN532_WAKEUP_RF;
+	if ((res = rfid_power_down (wakeup)) < 0)
+		return res;
+
+	/* sleep till timeout or PN532 IRQ signals RF activity */
+	pmu_timeout_start (timeout_us);
+	__disable_irq ();
+	while (!g_rfid_woken && !pmu_timeout_expired ())
+	{
+		__WFI ();
+		__enable_irq ();
+		__disable_irq ();
+	}
+	__enable_irq ();
+	pmu_timeout_stop ();
+
+	return g_rfid_woken ? 1 : 0;
+}
+
+int
+rfid_set_profile (TRfidProfileId id)
+{
+	int res;
+	unsigned char data[4];
+	const TRfidProfile *p;
+
+	if ((unsigned int) id >= RFID_PROFILES)
+		return -1;
+	p = &g_rfid_profile[id];
+
+	if (((res = rfid_execute_frame (p->timings, sizeof (p->timings),
+									data, sizeof (data))) < 0)
+		|| ((res = rfid_execute_frame (p->com, sizeof (p->com),
+									   data, sizeof (data))) < 0)
+		|| ((res = rfid_execute_frame (p->retries, sizeof (p->retries),
+									   data, sizeof (data))) < 0))
+	{
+		g_rfid_profile_id = -1;
+		return res;
+	}
+
+	g_rfid_profile_id = id;
+	return 0;
+}
+
+static uint16_t
+rfid_crc_a (const unsigned char *data, int len)
+{
+	unsigned char c;
+	uint16_t crc;
+
+	/* ISO/IEC 14443-3 CRC_A: reflected CRC-16/CCITT, preset 0x6363 */
+	crc = 0x6363;
+	while (len--)
+	{
+		c = *data++ ^ (unsigned char) crc;
+		c ^= c << 4;
+		crc = (crc >> 8) ^ (((uint16_t) c) << 8) ^ (((uint16_t) c) << 3) ^
+			(c >> 4);
+	}
+
+	return crc;
+}
+
+int
+rfid_transceive_raw (const void *tx, int txlen, uint8_t last_bits,
+					 void *rx, int rxsize, uint8_t flags)
+{
+	int res;
+	uint16_t crc;
+	TRfidRegister reg[3];
+	unsigned char cmd[1 + RFID_RAW_FRAME_SIZE + 2];
+
+	if ((txlen + 2) > RFID_RAW_FRAME_SIZE)
+		return -5;
+
+	if (!g_rfid_raw_active)
+	{
+		/* switch off hardware CRC, remember PN532 firmware setup */
+		if ((res = rfid_read_registers (g_rfid_raw_regs, g_rfid_raw_saved,
+										3)) < 0)
+			return res;
+
+		reg[0].address = PN532_CIU_TxMode;
+		reg[0].data = g_rfid_raw_saved[0] & ~PN532_CIU_CRC_EN;
+		reg[1].address = PN532_CIU_RxMode;
+		reg[1].data = g_rfid_raw_saved[1] & ~PN532_CIU_CRC_EN;
+		reg[2].address = PN532_CIU_BitFraming;
+		reg[2].data = (g_rfid_raw_saved[2] & ~0x07) | (last_bits & 0x07);
+		if ((res = rfid_write_registers (reg, 3)) < 0)
+			return res;
+
+		g_rfid_raw_active = TRUE;
+		g_rfid_raw_bits = last_bits & 0x07;
+	}
+	else if (g_rfid_raw_bits != (last_bits & 0x07))
+	{
+		/* only TxLastBits changed */
+		reg[0].address = PN532_CIU_BitFraming;
+		reg[0].data = (g_rfid_raw_saved[2] & ~0x07) | (last_bits & 0x07);
+		if ((res = rfid_write_registers (reg, 1)) < 0)
+			return res;
+		g_rfid_raw_bits = last_bits & 0x07;
+	}
+
+	cmd[0] = PN532_CMD_InCommunicateThru;
+	memcpy (&cmd[1], tx, txlen);
+	if (flags & RFID_RAW_CRC)
+	{
+		crc = rfid_crc_a (&cmd[1], txlen);
+		cmd[1 + txlen++] = crc & 0xFF;
+		cmd[1 + txlen++] = crc >> 8;
+	}
+
+	/* response: 0x43, status, raw card data */
+	if ((res = rfid_execute (&cmd, 1 + txlen, sizeof (cmd))) < 2)
+		return (res < 0) ? res : -1;
+	if (cmd[1] & 0x3F)
+		return -12;
+	res -= 2;
+
+	if (flags & RFID_RAW_CRC)
+	{
+		if ((res < 2) || rfid_crc_a (&cmd[2], res))
+			return -11;
+		res -= 2;
+	}
+
+	if (res > rxsize)
+		return -5;
+	memcpy (rx, &cmd[2], res);
+
+	return res;
+}
+
+int
+rfid_wupa (unsigned char *atqa)
+{
+	static const unsigned char wupa = ISO14443A_WUPA;
+
+	/* short frame, 7 bits, no CRC */
+	return rfid_transceive_raw (&wupa, sizeof (wupa), 7, atqa, 2, 0);
+}
+
+int
+rfid_hlta (void)
+{
+	int res;
+	unsigned char dummy;
+	static const unsigned char hlta[] = { ISO14443A_HLTA, 0x00 };
+
+	/* a halted card must not answer - PN532 reports a timeout */
+	res = rfid_transceive_raw (&hlta, sizeof (hlta), 0, &dummy,
+							   sizeof (dummy), RFID_RAW_CRC);
+	return (res == -12) ? 0 : (res < 0) ? res : -1;
+}
+
+int
+rfid_fast_read (unsigned char start, unsigned char end, void *data,
+				int size)
+{
+	unsigned char cmd[3];
+
+	cmd[0] = ISO14443A_FAST_READ;
+	cmd[1] = start;
+	cmd[2] = end;
+
+	/* four bytes per page */
+	if ((end < start) || (((end - start + 1) * 4) > size))
+		return -5;
+
+	return rfid_transceive_raw (&cmd, sizeof (cmd), 0, data, size,
+								RFID_RAW_CRC);
+}
+
+int
+rfid_write_register (unsigned short address, unsigned char data)
+{
+	unsigned char cmd[4];
+
+	/* write register */
+	cmd[0] = PN532_CMD_WriteRegister;
+	/* high byte of address */
+	cmd[1] = address >> 8;
+	/* low byte of address */
+	cmd[2] = address & 0xFF;
+	/* data value */
+	cmd[3] = data;
+
+	return rfid_execute (&cmd, sizeof (cmd), sizeof (data));
+}
+
+int
+rfid_read_register (unsigned short address)
+{
+	int res;
+	unsigned char cmd[3];
+
+	/* write register */
+	cmd[0] = PN532_CMD_ReadRegister;
+	/* high byte of address */
+	cmd[1] = address >> 8;
+	/* low byte of address */
+	cmd[2] = address & 0xFF;
+
+	if ((res = rfid_execute (&cmd, sizeof (cmd), sizeof (cmd))) > 1)
+		return cmd[1];
+	else
+		return res;
+}
+
+int
+rfid_mask_register (unsigned short address, unsigned char data,
+					unsigned char mask)
+{
+	int res;
+
+	if ((res = rfid_read_register (address)) < 0)
+		return res;
+	else
+		return rfid_write_register (address,
+									(((unsigned char) res) & (~mask)) | (data
+																		 &
+																		 mask));
+}
+
+int
+rfid_read_registers (const unsigned short *address, unsigned char *data,
+					 int count)
+{
+	int res, i, n, done;
+	unsigned char cmd[1 + (2 * RFID_REGISTER_BATCH)];
+
+	for (done = 0; done < count; done += n)
+	{
+		/* pack as many addresses as fit into one frame */
+		n = count - done;
+		if (n > RFID_REGISTER_BATCH)
+			n = RFID_REGISTER_BATCH;
+
+		cmd[0] = PN532_CMD_ReadRegister;
+		for (i = 0; i < n; i++)
+		{
+			cmd[1 + (i * 2)] = address[done + i] >> 8;
+			cmd[2 + (i * 2)] = address[done + i] & 0xFF;
+		}
+
+		/* response carries one value per address */
+		if ((res = rfid_execute (&cmd, 1 + (n * 2), sizeof (cmd))) < 0)
+			return res;
+		if (res < (1 + n))
+			return -1;
+
+		memcpy (&data[done], &cmd[1], n);
+	}
+
+	return done;
+}
+
+int
+rfid_write_registers (const TRfidRegister * reg, int count)
+{
+	int res, i, n, done;
+	unsigned char cmd[1 + (3 * RFID_REGISTER_BATCH)];
+
+	for (done = 0; done < count; done += n)
+	{
+		/* pack as many address/value pairs as fit into one frame */
+		n = count - done;
+		if (n > RFID_REGISTER_BATCH)
+			n = RFID_REGISTER_BATCH;
+
+		cmd[0] = PN532_CMD_WriteRegister;
+		for (i = 0; i < n; i++)
+		{
+			cmd[1 + (i * 3)] = reg[done + i].address >> 8;
+			cmd[2 + (i * 3)] = reg[done + i].address & 0xFF;
+			cmd[3 + (i * 3)] = reg[done + i].data;
+		}
+
+		if ((res = rfid_execute (&cmd, 1 + (n * 3), sizeof (cmd))) < 0)
+			return res;
+	}
+
+	return done;
+}
+
+int
+rfid_mask_registers (TRfidRegister * reg, const unsigned char *mask,
+					 int count)
+{
+	int res, i, n, reads, done;
+	TRfidRegister *r;
+	unsigned short address[RFID_REGISTER_BATCH];
+	unsigned char value[RFID_REGISTER_BATCH];
+
+	for (done = 0; done < count; done += n)
+	{
+		n = count - done;
+		if (n > RFID_REGISTER_BATCH)
+			n = RFID_REGISTER_BATCH;
+		r = &reg[done];
+
+		/* skip the read for registers that get fully overwritten */
+		for (reads = i = 0; i < n; i++)
+			if (mask[done + i] != 0xFF)
+				address[reads++] = r[i].address;
+
+		if (reads && ((res = rfid_read_registers (address, value, reads)) < 0))
+			return res;
+
+		/* merge new bits into current values, written back in one go */
+		for (reads = i = 0; i < n; i++)
+			if (mask[done + i] != 0xFF)
+				r[i].data = (value[reads++] & ~mask[done + i]) |
+					(r[i].data & mask[done + i]);
+
+		if ((res = rfid_write_registers (r, n)) < 0)
+			return res;
+	}
+
+	return done;
+}
+
+static BOOL
+rfid_diagnose_echo (void)
+{
+	int i;
+	unsigned char cmd[2 + 32], rsp[sizeof (cmd)];
+
+	/* communication line test, PN532 echoes the data */
+	cmd[0] = PN532_CMD_Diagnose;
+	cmd[1] = 0x00;
+	for (i = 2; i < (int) sizeof (cmd); i++)
+		cmd[i] = (unsigned char) ((i * 0x3B) ^ 0xA5);
+
+	memcpy (rsp, cmd, sizeof (cmd));
+	if (rfid_execute (rsp, sizeof (cmd), sizeof (rsp)) != sizeof (cmd))
+		return FALSE;
+
+	return (rsp[0] == (PN532_CMD_Diagnose + 1)) &&
+		(memcmp (&rsp[1], &cmd[1], sizeof (cmd) - 1) == 0);
+}
+
+int
+rfid_calibrate (void)
+{
+	int i;
+	uint8_t step;
+
+	/* step SPI clock up until echo frames start failing */
+	for (step = 0; step < sizeof (g_rfid_cpsdvsr); step++)
+	{
+		rfid_set_step (step);
+		for (i = 0; i < RFID_CALIBRATE_ROUNDS; i++)
+			if (!rfid_diagnose_echo ())
+				break;
+		if (i < RFID_CALIBRATE_ROUNDS)
+			break;
+	}
+
+	/* settle on the last stable step and resync PN532 */
+	rfid_set_step (step ? step - 1 : 0);
+	rfid_abort ();
+	g_rfid_stats.crc_errors = 0;
+
+	debug ("RFID: SPI calibrated to %uHz\n", g_rfid_stats.spi_hz);
+
+	return step ? (int) g_rfid_stats.spi_hz : -1;
+}
+
+spi_cs
+rfid_spi_cs (void)
+{
+	return g_rfid_cs;
+}
+
+uint32_t
+rfid_irq_cycles (void)
+{
+	return g_rfid_irq_cycles;
+}
+
+const TRfidStats *
+rfid_stats (void)
+{
+	return &g_rfid_stats;
+}
+
+void
+rfid_status (TRfidPrintf print)
+{
+	print (" * PN532 SPI: CLK:%uHz CPSDVSR:%u CRC errors:%u fallbacks:%u\n",
+		   g_rfid_stats.spi_hz, g_rfid_stats.cpsdvsr,
+		   g_rfid_stats.crc_errors, g_rfid_stats.fallbacks);
+	print (" * PN532 RF profile: %s\n", (g_rfid_profile_id < 0) ?
+		   "none" : g_rfid_profile[g_rfid_profile_id].name);
+	print (" * PN532 link: retransmits:%u ACK timeouts:%u resends:%u"
+		   " flushes:%u resets:%u\n", g_rfid_stats.retransmits,
+		   g_rfid_stats.ack_timeouts, g_rfid_stats.resends,
+		   g_rfid_stats.flushes, g_rfid_stats.resets);
+	rfid_histogram (print);
+}
+
+static void
+rfid_benchmark_mode (TRfidPrintf print, TRfidReadyMode mode, int rounds)
+{
+	int i, res, errors;
+	uint32_t start, t, t_min, t_max, t_sum, mhz;
+	unsigned char data[PN532_FIFO_SIZE];
+
+	rfid_set_ready_mode (mode);
+	memset (&g_rfid_ready_stats, 0, sizeof (g_rfid_ready_stats));
+
+	errors = 0;
+	t_sum = t_max = 0;
+	t_min = 0xFFFFFFFFUL;
+	for (i = 0; i < rounds; i++)
+	{
+		start = DWT_CYCCNT;
+		res = rfid_execute_frame (rfid_frame_get_firmware_version,
+								  sizeof (rfid_frame_get_firmware_version),
+								  data, sizeof (data));
+		t = DWT_CYCCNT - start;
+
+		if (res < 0)
+		{
+			errors++;
+			continue;
+		}
+
+		t_sum += t;
+		if (t < t_min)
+			t_min = t;
+		if (t > t_max)
+			t_max = t;
+	}
+
+	mhz = SystemCoreClock / 1000000;
+	if (errors >= rounds)
+		t_min = t_sum = 0;
+	else
+		t_sum /= rounds - errors;
+
+	print (" * %s: avg:%uus min:%uus max:%uus polls:%u busy:%uus errors:%u\n",
+		   (mode == RFID_READY_IRQ) ? "IRQ pin" : "SPI status",
+		   t_sum / mhz, t_min / mhz, t_max / mhz,
+		   g_rfid_ready_stats.polls, g_rfid_ready_stats.busy_cycles / mhz,
+		   errors);
+}
+
+void
+rfid_benchmark (TRfidPrintf print, int rounds)
+{
+	TRfidReadyMode mode;
+
+	/* compare GetFirmwareVersion round trips for both strategies */
+	mode = g_rfid_ready_mode;
+	print (" * PN532 readiness benchmark, %u x GetFirmwareVersion\n",
+		   rounds);
+	rfid_benchmark_mode (print, RFID_READY_IRQ, rounds);
+	rfid_benchmark_mode (print, RFID_READY_SPI_STATUS, rounds);
+	rfid_set_ready_mode (mode);
+}
+
+void
+rfid_histogram (TRfidPrintf print)
+{
+#ifdef  ENABLE_PN532_HISTOGRAM
+	int i, phase, bucket;
+	const TRfidHistogram *h;
+
+	print (" * PN532 latency log2 histograms, bucket 0 = %u cycles,"
+		   " dropped:%u\n", 1UL << RFID_HIST_SHIFT, g_rfid_hist_dropped);
+
+	for (i = 0; i < RFID_HIST_COMMANDS; i++)
+	{
+		h = &g_rfid_hist[i];
+		if (!h->used)
+			break;
+
+		for (phase = 0; phase < RFID_PHASES; phase++)
+		{
+			print ("   0x%02X %s:", h->code, g_rfid_phase_name[phase]);
+			for (bucket = 0; bucket < RFID_HIST_BUCKETS; bucket++)
+				print (" %u", h->count[phase][bucket]);
+			print ("\n");
+		}
+	}
+#else
+	(void) print;
+#endif /*ENABLE_PN532_HISTOGRAM */
+}
+
+void
+rfid_histogram_reset (void)
+{
+#ifdef  ENABLE_PN532_HISTOGRAM
+	__disable_irq ();
+	memset (&g_rfid_hist, 0, sizeof (g_rfid_hist));
+	g_rfid_hist_dropped = 0;
+	__enable_irq ();
+#endif /*ENABLE_PN532_HISTOGRAM */
+}
+
+void
+rfid_init (void)
+{
+	/* Initialize RESET line */
+	GPIOSetDir (PN532_RESET_PORT, PN532_RESET_PIN, 1);
+
+	/* reset PN532 */
+	GPIOSetValue (PN532_RESET_PORT, PN532_RESET_PIN, 0);
+
+	/* initialize PN532 IRQ line */
+	GPIOSetDir (PN532_IRQ_PORT, PN532_IRQ_PIN, 0);
+
+	/* falling edge on PN532 IRQ line wakes up the core */
+	LPC_GPIO[PN532_IRQ_PORT]->IS &= ~(1 << PN532_IRQ_PIN);
+	LPC_GPIO[PN532_IRQ_PORT]->IBE &= ~(1 << PN532_IRQ_PIN);
+	LPC_GPIO[PN532_IRQ_PORT]->IEV &= ~(1 << PN532_IRQ_PIN);
+	LPC_GPIO[PN532_IRQ_PORT]->IC = 1 << PN532_IRQ_PIN;
+	LPC_GPIO[PN532_IRQ_PORT]->IE |= 1 << PN532_IRQ_PIN;
+	rfid_set_ready_mode (g_rfid_ready_mode);
 
 	/* init RFID SPI interface */
 	spi_init ();
 	spi_init_pin (SPI_CS_PN532);
+	rfid_set_step (0);
 
 	/* release reset line after 400ms */
 	pmu_wait_ms (400);
 	GPIOSetValue (PN532_RESET_PORT, PN532_RESET_PIN, 1);
 
 	/* wait for PN532 to boot */
-	pmu_wait_ms (100);
+	pmu_wait_ms (RFID_RESET_BOOT_US / 1000);
 }
 
 #endif /*ENABLE_PN532_RFID */
@@ -25,108 +25,362 @@
 
 #define BIT_REVERSE(x) ((unsigned char)(__RBIT(x)>>24))
 
+/* depth of SSP TX and RX FIFOs */
+#define SPI_FIFO_SIZE 8
+
 void
 spi_init_pin (spi_cs chipselect)
 {
-	GPIOSetDir ((uint8_t) (chipselect >> 24), (uint8_t) (chipselect >> 16),
-				1);
+	GPIOSetDir (SPI_CS_PORT (chipselect), SPI_CS_PIN (chipselect), 1);
+}
+
+static void
+spi_cs_release (spi_cs chipselect)
+{
+	GPIOSetValue (SPI_CS_PORT (chipselect), SPI_CS_PIN (chipselect),
+				  (chipselect & SPI_CS_MODE_INVERT_CS) ^
+				  SPI_CS_MODE_INVERT_CS);
 }
 
 void
 spi_txrx_done (spi_cs chipselect)
 {
-	GPIOSetValue ((uint8_t) (chipselect >> 24),
-				  (uint8_t) (chipselect >> 16), (chipselect
-												 & SPI_CS_MODE_INVERT_CS) ^
-				  SPI_CS_MODE_INVERT_CS);
+	/* chip select hold time */
+	if (SPI_CS_DELAY_US (chipselect))
+		pmu_wait_us (SPI_CS_DELAY_US (chipselect));
+
+	spi_cs_release (chipselect);
 }
 
-int
-spi_txrx (spi_cs chipselect, const void *tx, uint16_t txlen, void *rx,
-		  uint16_t rxlen)
+/* SSP interrupt mask bits */
+#define SSP_IMSC_RTIM 0x02
+#define SSP_IMSC_RXIM 0x04
+#define SSP_IMSC_TXIM 0x08
+/* SSP interrupt clear bits */
+#define SSP_ICR_RORIC 0x01
+#define SSP_ICR_RTIC 0x02
+
+typedef struct
 {
-	uint8_t data;
+	spi_cs chipselect;
+	const uint8_t *tx;
+	uint8_t *rx;
+	uint16_t txlen, rxlen;
 	uint16_t total, xfered;
+	TSpiCallback callback;
+	void *context;
+	BOOL irq;
+	/* chip select hold time running on CT16B1 */
+	BOOL hold;
+} TSpiTransfer;
+
+static TSpiTransfer g_spi;
+static volatile BOOL g_spi_busy;
+
+static void
+spi_xfer_fill (void)
+{
+	uint16_t data;
 
-	/* SSP0 Clock Prescale Register to SYSCLK/CPSDVSR */
-	LPC_SSP->CPSR = (chipselect >> 8) & 0xFF;
+	/* keep TX FIFO filled without overrunning the RX FIFO */
+	while (g_spi.total && ((g_spi.xfered - g_spi.total) < SPI_FIFO_SIZE)
+		   && (LPC_SSP->SR & 2))
+	{
+		g_spi.total--;
 
-	/* 9 bit for LCD / 8 bit for others , SPI, SCR=0 */
-	LPC_SSP->CR0 = (chipselect & SPI_CS_MODE_LCD) ? 8 : 7;
+		if (g_spi.txlen)
+		{
+			g_spi.txlen--;
+			data = g_spi.tx ? *g_spi.tx++ : 0;
 
-	/* activate chip select */
-	if ((chipselect & SPI_CS_MODE_SKIP_CS_ASSERT) == 0)
-		GPIOSetValue ((uint8_t) (chipselect >> 24),
-					  (uint8_t) (chipselect >> 16), chipselect
-					  & SPI_CS_MODE_INVERT_CS);
+			if (g_spi.chipselect & SPI_CS_MODE_BIT_REVERSED)
+				data = BIT_REVERSE (data);
+		}
+		else
+			data = 0;
 
-	/* wait for chip to come up */
-	pmu_wait_ms (1);
+		if (g_spi.chipselect & SPI_CS_MODE_LCD)
+		{
+			/* if SPI_CS_MODE_LCDCMD is set, transmit first byte as CMD ... */
+			if (g_spi.chipselect & SPI_CS_MODE_LCD_CMD)
+				g_spi.chipselect ^= SPI_CS_MODE_LCD_CMD;
+			else
+				/* ... and remaining bytes as data */
+				data |= 0x100U;
+		}
 
-	/* calculate SPI transaction size */
-	xfered = total = (chipselect & SPI_CS_MODE_SKIP_TX) ? rxlen + txlen
-		: (txlen >= rxlen) ? txlen : rxlen;
+		LPC_SSP->DR = data;
+	}
+}
 
-	while (xfered)
+static void
+spi_xfer_drain (void)
+{
+	uint8_t data;
+
+	while (LPC_SSP->SR & 0x04)
 	{
-		if (total)
+		data = LPC_SSP->DR;
+		g_spi.xfered--;
+
+		/* skip txlen in output if SPI_CS_MODE_SKIP_TX */
+		if (g_spi.rxlen && (g_spi.xfered < g_spi.rxlen))
 		{
-			total--;
+			g_spi.rxlen--;
+			if (g_spi.chipselect & SPI_CS_MODE_BIT_REVERSED)
+				data = BIT_REVERSE (data);
+			*g_spi.rx++ = data;
+		}
+	}
+}
 
-			if (txlen)
-			{
-				txlen--;
-				data = *((uint8_t *) tx);
-				tx = ((uint8_t *) tx) + 1;
+static void
+spi_xfer_finish (void)
+{
+	TSpiCallback callback;
 
-				if (chipselect & SPI_CS_MODE_BIT_REVERSED)
-					data = BIT_REVERSE (data);
-			}
-			else
-				data = 0;
+	/* de-activate chip select */
+	if ((g_spi.chipselect & SPI_CS_MODE_SKIP_CS_DEASSERT) == 0)
+		spi_cs_release (g_spi.chipselect);
+
+	/* completion callback may start the next transfer */
+	callback = g_spi.callback;
+	g_spi.hold = FALSE;
+	g_spi_busy = FALSE;
+	if (callback)
+		callback (0, g_spi.context);
+}
 
-			/* Wait if TX fifo is full */
-			while ((LPC_SSP->SR & 2) == 0);
+static void
+spi_xfer_service (void)
+{
+	spi_xfer_drain ();
+	spi_xfer_fill ();
 
-			if (chipselect & SPI_CS_MODE_LCD)
-			{
-				/* if SPI_CS_MODE_LCDCMD is set, transmit first byte as CMD ... */
-				if (chipselect & SPI_CS_MODE_LCD_CMD)
-				{
-					chipselect ^= SPI_CS_MODE_LCD_CMD;
-					LPC_SSP->DR = data;
-				}
-				else
-					/* ... and remaining bytes as data */
-					LPC_SSP->DR = 0x100U | data;
-			}
-			else
-				LPC_SSP->DR = data;
+	if (g_spi.xfered)
+	{
+		/* TX half empty is only of interest while bytes are left */
+		if (g_spi.irq)
+			LPC_SSP->IMSC = g_spi.total ?
+				(SSP_IMSC_RTIM | SSP_IMSC_RXIM | SSP_IMSC_TXIM) :
+				(SSP_IMSC_RTIM | SSP_IMSC_RXIM);
+		return;
+	}
+
+	LPC_SSP->IMSC = 0;
+
+	/* Wait for TX transaction to finish */
+	while ((LPC_SSP->SR & 1) == 0);
+
+	/* time chip select hold instead of spinning in interrupt context,
+	   transfer stays busy till the CT16B1 match */
+	if (((g_spi.chipselect & SPI_CS_MODE_SKIP_CS_DEASSERT) == 0)
+		&& SPI_CS_DELAY_US (g_spi.chipselect))
+	{
+		g_spi.hold = TRUE;
+		LPC_TMR16B1->TCR = 2;
+		LPC_TMR16B1->MR0 = SPI_CS_DELAY_US (g_spi.chipselect);
+		LPC_TMR16B1->TCR = 1;
+		return;
+	}
+
+	spi_xfer_finish ();
+}
+
+static void
+spi_xfer_hold_done (void)
+{
+	LPC_TMR16B1->IR = 1;
+	NVIC_ClearPendingIRQ (TIMER_16_1_IRQn);
+
+	if (g_spi.hold)
+		spi_xfer_finish ();
+}
+
+void
+TIMER16_1_IRQHandler (void)
+{
+	spi_xfer_hold_done ();
+}
+
+void
+SSP_IRQHandler (void)
+{
+	/* RX timeout is cleared explicitly, FIFO levels by servicing */
+	LPC_SSP->ICR = SSP_ICR_RORIC | SSP_ICR_RTIC;
+
+	if (g_spi_busy)
+		spi_xfer_service ();
+	else
+		LPC_SSP->IMSC = 0;
+}
+
+BOOL
+spi_txrx_busy (void)
+{
+	return g_spi_busy;
+}
+
+void
+spi_txrx_wait (void)
+{
+	uint32_t primask;
+
+	/* drive transfer by polling, safe from any interrupt priority */
+	primask = __get_PRIMASK ();
+	while (g_spi_busy)
+	{
+		__disable_irq ();
+		if (g_spi.hold)
+		{
+			/* timer IRQ might be masked at our priority */
+			if (LPC_TMR16B1->IR & 1)
+				spi_xfer_hold_done ();
+		}
+		else if (g_spi_busy)
+			spi_xfer_service ();
+		__set_PRIMASK (primask);
+	}
+}
+
+void
+spi_txrx_begin (spi_cs chipselect)
+{
+	/* finish interrupt driven transfer first */
+	spi_txrx_wait ();
+
+	/* SSP0 Clock Prescale Register to SYSCLK/CPSDVSR */
+	LPC_SSP->CPSR = SPI_CS_CPSDVSR (chipselect);
+
+	/* 9 bit for LCD / 8 bit for others , SPI, SCR=0 */
+	LPC_SSP->CR0 = (chipselect & SPI_CS_MODE_LCD) ? 8 : 7;
+
+	/* flush stale data from RX FIFO */
+	while (LPC_SSP->SR & 0x04)
+		(void) LPC_SSP->DR;
+
+	/* activate chip select, wait for chip select setup time */
+	if ((chipselect & SPI_CS_MODE_SKIP_CS_ASSERT) == 0)
+	{
+		GPIOSetValue (SPI_CS_PORT (chipselect), SPI_CS_PIN (chipselect),
+					  chipselect & SPI_CS_MODE_INVERT_CS);
+
+		if (SPI_CS_DELAY_US (chipselect))
+			pmu_wait_us (SPI_CS_DELAY_US (chipselect));
+	}
+}
+
+void
+spi_txrx_burst (spi_cs chipselect, const void *tx, void *rx, uint16_t len)
+{
+	uint8_t data;
+	uint16_t pending;
+	const uint8_t *src;
+	uint8_t *dst;
+
+	src = (const uint8_t *) tx;
+	dst = (uint8_t *) rx;
+	pending = len;
+
+	while (pending)
+	{
+		/* keep TX FIFO filled without overrunning the RX FIFO */
+		while (len && ((pending - len) < SPI_FIFO_SIZE)
+			   && (LPC_SSP->SR & 2))
+		{
+			len--;
+			data = src ? *src++ : 0;
+			if (chipselect & SPI_CS_MODE_BIT_REVERSED)
+				data = BIT_REVERSE (data);
+			LPC_SSP->DR = data;
 		}
 
+		/* drain RX FIFO */
 		while (LPC_SSP->SR & 0x04)
 		{
 			data = LPC_SSP->DR;
-			xfered--;
+			pending--;
 
-			/* skip txlen in output if SPI_CS_MODE_SKIP_TX */
-			if (rxlen && (xfered < rxlen))
+			if (dst)
 			{
-				rxlen--;
 				if (chipselect & SPI_CS_MODE_BIT_REVERSED)
 					data = BIT_REVERSE (data);
-				*((uint8_t *) rx) = data;
-				rx = ((uint8_t *) rx) + 1;
+				*dst++ = data;
 			}
 		}
 	}
+}
 
-	/* Wait for TX transaction to finish */
-	while ((LPC_SSP->SR & 1) == 0);
+static void
+spi_xfer_start (spi_cs chipselect, const void *tx, uint16_t txlen, void *rx,
+				uint16_t rxlen, TSpiCallback callback, void *context, BOOL irq)
+{
+	/* program SSP, assert chip select */
+	spi_txrx_begin (chipselect);
+
+	g_spi.chipselect = chipselect;
+	g_spi.tx = (const uint8_t *) tx;
+	g_spi.rx = (uint8_t *) rx;
+	g_spi.txlen = txlen;
+	g_spi.rxlen = rxlen;
+	g_spi.callback = callback;
+	g_spi.context = context;
+	g_spi.irq = irq;
+	g_spi.hold = FALSE;
 
-	/* de-activate chip select */
-	if ((chipselect & SPI_CS_MODE_SKIP_CS_DEASSERT) == 0)
-		spi_txrx_done (chipselect);
+	/* calculate SPI transaction size */
+	g_spi.xfered = g_spi.total = (chipselect & SPI_CS_MODE_SKIP_TX) ?
+		rxlen + txlen : (txlen >= rxlen) ? txlen : rxlen;
+
+	g_spi_busy = TRUE;
+}
+
+int
+spi_txrx_async (spi_cs chipselect, const void *tx, uint16_t txlen, void *rx,
+				uint16_t rxlen, TSpiCallback callback, void *context)
+{
+	uint32_t primask;
+
+	/* completion callbacks chain transfers from within masked
+	   sections - keep interrupts masked for them */
+	primask = __get_PRIMASK ();
+	__disable_irq ();
+	if (g_spi_busy)
+	{
+		__set_PRIMASK (primask);
+		return -10;
+	}
+	spi_xfer_start (chipselect, tx, txlen, rx, rxlen, callback, context,
+					TRUE);
+
+	/* prime FIFO, interrupts take over from here */
+	spi_xfer_service ();
+	__set_PRIMASK (primask);
+
+	return 0;
+}
+
+int
+spi_txrx (spi_cs chipselect, const void *tx, uint16_t txlen, void *rx,
+		  uint16_t rxlen)
+{
+	uint32_t primask;
+
+	/* synchronous wrapper around the interrupt driven engine,
+	   a completion callback might have started another transfer */
+	primask = __get_PRIMASK ();
+	while (TRUE)
+	{
+		spi_txrx_wait ();
+		__disable_irq ();
+		if (!g_spi_busy)
+			break;
+		__set_PRIMASK (primask);
+	}
+	spi_xfer_start (chipselect, tx, txlen, rx, rxlen, NULL, NULL, FALSE);
+	__set_PRIMASK (primask);
+
+	spi_txrx_wait ();
 
 	return 0;
 }
@@ -162,11 +416,33 @@ spi_init (void)
 	/* 8 bit, SPI, SCR=0 */
 	LPC_SSP->CR0 = 0x0007;
 	LPC_SSP->CR1 = 0x0002;
+
+	/* interrupt driven transfers */
+	LPC_SSP->IMSC = 0;
+	LPC_SSP->ICR = SSP_ICR_RORIC | SSP_ICR_RTIC;
+	NVIC_EnableIRQ (SSP_IRQn);
+
+	/* CT16B1 times chip select hold in microseconds, one shot:
+	   IRQ, reset and stop on MR0 match */
+	LPC_SYSCON->SYSAHBCLKCTRL |= EN_CT16B1;
+	LPC_TMR16B1->TCR = 2;
+	LPC_TMR16B1->PR =
+		((SystemCoreClock / LPC_SYSCON->SYSAHBCLKDIV) / 1000000) - 1;
+	LPC_TMR16B1->EMR = 0;
+	LPC_TMR16B1->MCR = 7;
+	LPC_TMR16B1->IR = 1;
+	NVIC_EnableIRQ (TIMER_16_1_IRQn);
 }
 
 void
 spi_close (void)
 {
+	/* finish pending transfer */
+	spi_txrx_wait ();
+	NVIC_DisableIRQ (SSP_IRQn);
+	NVIC_DisableIRQ (TIMER_16_1_IRQn);
+	LPC_SYSCON->SYSAHBCLKCTRL &= ~EN_CT16B1;
+
 	/* Disable SSP clock */
 	LPC_SYSCON->SYSAHBCLKCTRL &= ~(1 << 11);
 
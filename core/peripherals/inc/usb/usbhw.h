@@ -56,6 +56,7 @@ extern void USB_ClearEPBuf (uint32_t EPNum);
 extern uint32_t USB_ReadEP (uint32_t EPNum, uint8_t * pData);
 extern void USB_ReadEP_Terminate (uint32_t EPNum);
 extern uint32_t USB_ReadEP_Count (uint32_t EPNum);
+extern uint32_t USB_EP_Full (uint32_t EPNum);
 extern uint32_t USB_WriteEP (uint32_t EPNum, uint8_t * pData, uint32_t cnt);
 extern void USB_WriteEP_Terminate (uint32_t EPNum);
 extern void USB_WriteEP_Count (uint32_t EPNum, uint32_t cnt);
@@ -443,6 +443,26 @@ USB_ReadEP_Count (uint32_t EPNum)
 }
 
 
+/*
+ *  Check USB Endpoint Buffers Full
+ *    Parameters:      EPNum: Endpoint Number
+ *                       EPNum.0..3: Address
+ *                       EPNum.7:    Dir
+ *    Return Value:    non-zero if the endpoint buffer is full
+ *
+ *  OUT checks the next buffer to read: a received packet is waiting,
+ *  delaying USB_ReadEP_Terminate makes the hardware NAK the host.
+ *  IN checks the current buffer: writing would overwrite a packet
+ *  the host has not fetched yet.
+ */
+
+uint32_t
+USB_EP_Full (uint32_t EPNum)
+{
+  WrCmd (CMD_SEL_EP (EPAdr (EPNum)));
+  return RdCmdDat (DAT_SEL_EP (EPAdr (EPNum))) & EP_SEL_F;
+}
+
 /*
  *  Read USB Endpoint Data: Finalize Read 
  *    Parameters:      EPNum: Endpoint Number
@@ -0,0 +1,136 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - host side helpers for libnfc bridge batches
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+#include <string.h>
+#include "pn532batch.h"
+
+void pn532_batch_init(pn532_batch_t *batch, uint8_t flags)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->payload[0] = PN532_BATCH_TFI;
+	batch->payload[1] = flags;
+	batch->size = 2;
+}
+
+int pn532_batch_add(pn532_batch_t *batch, const void *cmd, int len)
+{
+	if (len < 1 || len > 0xFF ||
+	    (batch->size + 1 + len) > PN532_BATCH_MAX_PAYLOAD)
+		return -1;
+
+	batch->payload[batch->size++] = (uint8_t) len;
+	memcpy(&batch->payload[batch->size], cmd, len);
+	batch->size += len;
+
+	return batch->count++;
+}
+
+int pn532_batch_frame(const pn532_batch_t *batch, uint8_t *frame, int size)
+{
+	int pos, i;
+	uint8_t crc;
+
+	if (size < (batch->size + 10))
+		return -1;
+
+	pos = 0;
+	frame[pos++] = 0x00;
+	frame[pos++] = 0x00;
+	frame[pos++] = 0xFF;
+
+	if (batch->size < 0xFF) {
+		frame[pos++] = (uint8_t) batch->size;
+		frame[pos++] = (uint8_t) - batch->size;
+	} else {
+		frame[pos++] = 0xFF;
+		frame[pos++] = 0xFF;
+		frame[pos++] = (uint8_t) (batch->size >> 8);
+		frame[pos++] = (uint8_t) batch->size;
+		frame[pos] = (uint8_t) - (frame[pos - 2] + frame[pos - 1]);
+		pos++;
+	}
+
+	crc = 0;
+	for (i = 0; i < batch->size; i++)
+		crc += frame[pos++] = batch->payload[i];
+	frame[pos++] = (uint8_t) - crc;
+	frame[pos++] = 0x00;
+
+	return pos;
+}
+
+int pn532_batch_parse(const uint8_t *frame, int len,
+		      pn532_batch_result_t *result, int max)
+{
+	int pos, size, count, i;
+	uint8_t crc;
+
+	/* skip to 00 FF start code */
+	for (pos = 1; pos < len; pos++)
+		if (frame[pos - 1] == 0x00 && frame[pos] == 0xFF)
+			break;
+	pos++;
+	if ((pos + 2) > len)
+		return -3;
+
+	if (frame[pos] == 0xFF && frame[pos + 1] == 0xFF) {
+		if ((pos + 5) > len)
+			return -3;
+		if ((uint8_t) (frame[pos + 2] + frame[pos + 3] + frame[pos + 4]))
+			return -4;
+		size = (frame[pos + 2] << 8) | frame[pos + 3];
+		pos += 5;
+	} else {
+		if ((uint8_t) (frame[pos] + frame[pos + 1]))
+			return -4;
+		size = frame[pos];
+		pos += 2;
+	}
+
+	/* TFI, COUNT, responses and DCS */
+	if (size < 2 || (pos + size + 1) > len)
+		return -5;
+	if (frame[pos] != PN532_BATCH_TFI_RESPONSE)
+		return -6;
+
+	crc = 0;
+	for (i = 0; i <= size; i++)
+		crc += frame[pos + i];
+	if (crc)
+		return -7;
+
+	count = frame[pos + 1];
+	len = pos + size;
+	pos += 2;
+
+	/* {STATUS LEN DATA...} per executed command */
+	for (i = 0; i < count; i++) {
+		if ((pos + 2) > len || (pos + 2 + frame[pos + 1]) > len)
+			return -5;
+		if (i < max) {
+			result[i].status = (int8_t) frame[pos];
+			result[i].len = frame[pos + 1];
+			result[i].data = &frame[pos + 2];
+		}
+		pos += 2 + frame[pos + 1];
+	}
+
+	return count;
+}
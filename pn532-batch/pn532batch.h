@@ -0,0 +1,61 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - host side helpers for libnfc bridge batches
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef __PN532BATCH_H__
+#define __PN532BATCH_H__
+
+#include <stdint.h>
+
+/* must match LIBNFC_TFI_BATCH* in the badge firmware */
+#define PN532_BATCH_TFI 0xD6
+#define PN532_BATCH_TFI_RESPONSE 0xD7
+/* stop at first failing command */
+#define PN532_BATCH_ABORT 0x01
+
+#define PN532_BATCH_MAX_PAYLOAD 264
+/* extended header, payload, DCS and postamble */
+#define PN532_BATCH_MAX_FRAME (PN532_BATCH_MAX_PAYLOAD + 10)
+
+typedef struct {
+	/* TFI, flags and {LEN CMD PARAMS...} entries */
+	uint8_t payload[PN532_BATCH_MAX_PAYLOAD];
+	int size;
+	int count;
+} pn532_batch_t;
+
+typedef struct {
+	/* zero or negative badge side rfid_execute error */
+	int status;
+	/* PN532 response starting with command code + 1 */
+	const uint8_t *data;
+	int len;
+} pn532_batch_result_t;
+
+void pn532_batch_init(pn532_batch_t *batch, uint8_t flags);
+/* append a command (command code followed by parameters) */
+int pn532_batch_add(pn532_batch_t *batch, const void *cmd, int len);
+/* wrap batch into a normal or extended PN532 frame for the CDC port */
+int pn532_batch_frame(const pn532_batch_t *batch, uint8_t *frame, int size);
+/* check response frame, returns the number of executed commands */
+int pn532_batch_parse(const uint8_t *frame, int len,
+		      pn532_batch_result_t *result, int max);
+
+#endif /*__PN532BATCH_H__*/
@@ -0,0 +1,87 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - strip libnfc bridge timestamp trailers
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#include <string.h>
+#include "pn532trailer.h"
+
+int pn532_frame_size(const uint8_t *buf, int len)
+{
+	if (len < 5)
+		return 0;
+	if (buf[0] != 0x00 || buf[1] != 0x00 || buf[2] != 0xFF)
+		return -1;
+
+	/* ACK/NACK: LEN and LCS followed by postamble */
+	if ((buf[3] == 0x00 && buf[4] == 0xFF) ||
+	    (buf[3] == 0xFF && buf[4] == 0x00))
+		return 6;
+
+	/* extended frame */
+	if (buf[3] == 0xFF && buf[4] == 0xFF) {
+		if (len < 8)
+			return 0;
+		return 8 + ((buf[5] << 8) | buf[6]) + 2;
+	}
+
+	return 5 + buf[3] + 2;
+}
+
+int pn532_trailer_strip(uint8_t *buf, int len, int *used,
+			pn532_trailer_t *stamp, int max, int *count)
+{
+	int pos, out, size;
+	const uint8_t *t;
+
+	pos = out = 0;
+	*count = 0;
+	while (pos < len) {
+		size = pn532_frame_size(&buf[pos], len - pos);
+		if (size < 0) {
+			/* resync on next preamble */
+			buf[out++] = buf[pos++];
+			continue;
+		}
+		if (!size || (pos + size + PN532_TRAILER_SIZE) > len)
+			break;
+
+		memmove(&buf[out], &buf[pos], size);
+		out += size;
+		pos += size;
+
+		t = &buf[pos];
+		if (*count < max) {
+			stamp[*count].irq_cycles =
+			    t[0] | (t[1] << 8) | (t[2] << 16) |
+			    ((uint32_t) t[3] << 24);
+			stamp[*count].spi_cycles =
+			    t[4] | (t[5] << 8) | (t[6] << 16) |
+			    ((uint32_t) t[7] << 24);
+			stamp[*count].clock_hz =
+			    t[8] | (t[9] << 8) | (t[10] << 16) |
+			    ((uint32_t) t[11] << 24);
+			(*count)++;
+		}
+		pos += PN532_TRAILER_SIZE;
+	}
+
+	*used = pos;
+	return out;
+}
@@ -0,0 +1,62 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - strip libnfc bridge timestamp trailers
+ *
+ * With ENABLE_LIBNFC_TIMESTAMPS the badge appends twelve bytes to
+ * every frame it sends to the host: the DWT cycle count of the
+ * PN532 IRQ edge, the one of the last host frame written to SPI
+ * and the core clock in Hz, all 32 bit little endian. Frames the
+ * badge generated itself (early ACKs, batch responses) carry a
+ * zero IRQ stamp.
+ *
+ ***************************************************************
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef __PN532TRAILER_H__
+#define __PN532TRAILER_H__
+
+#include <stdint.h>
+
+#define PN532_TRAILER_SIZE 12
+
+typedef struct {
+	/* cycle count of the PN532 IRQ edge, 0 for badge generated frames */
+	uint32_t irq_cycles;
+	/* cycle count when the last host frame finished on SPI */
+	uint32_t spi_cycles;
+	/* badge core clock in Hz, rate of the cycle counts */
+	uint32_t clock_hz;
+} pn532_trailer_t;
+
+/* size of the frame at the start of buf including postamble,
+   0 if incomplete, -1 if buf does not start with a frame */
+int pn532_frame_size(const uint8_t *buf, int len);
+/* strip trailers in place, returns the stripped length - the
+   unprocessed tail starts at buf + *used and needs more data */
+int pn532_trailer_strip(uint8_t *buf, int len, int *used,
+			pn532_trailer_t *stamp, int max, int *count);
+/* difference of two cycle counts of stamp in microseconds, handles
+   wrap - 0 if the badge reported no clock */
+static inline uint32_t pn532_trailer_us(const pn532_trailer_t *stamp,
+					uint32_t from, uint32_t to)
+{
+	if (!stamp->clock_hz)
+		return 0;
+	return (uint64_t) (to - from) * 1000000 / stamp->clock_hz;
+}
+
+#endif /*__PN532TRAILER_H__*/
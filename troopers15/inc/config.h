@@ -57,8 +57,24 @@
 #define PN532_IRQ_PIN 4
 #define PN532_CS_PORT 0
 #define PN532_CS_PIN 2
+/* poll SPI status byte instead of PN532 IRQ line for readiness,
+   needed for boards with the IRQ line unrouted */
+/* #define PN532_READY_SPI_STATUS */
+/* per-command latency histograms, dumped with the status over CDC,
+   costs RFID_HIST_COMMANDS*RFID_PHASES*RFID_HIST_BUCKETS*2 bytes RAM */
+/* #define ENABLE_PN532_HISTOGRAM */
+/* libnfc bridge ACKs validated host frames itself and hides the
+   PN532 ACK, saving one USB turnaround per command */
+/* #define ENABLE_LIBNFC_EARLY_ACK */
+/* libnfc bridge appends PN532 IRQ and SPI write DWT cycle counts and
+   the core clock to each frame sent to the host, see
+   pn532-batch/pn532trailer.h */
+/* #define ENABLE_LIBNFC_TIMESTAMPS */
+/* benchmark both readiness strategies at boot */
+/* #define PN532_BENCHMARK */
 
-/* SPI_CS(io_port, io_pin, CPSDVSR frequency, mode) */
-#define SPI_CS_PN532 SPI_CS( PN532_CS_PORT, PN532_CS_PIN, 64, SPI_CS_MODE_SKIP_TX|SPI_CS_MODE_BIT_REVERSED )
+/* SPI_CS(io_port, io_pin, CPSDVSR frequency, CS setup/hold us, mode),
+   CPSDVSR is replaced at runtime by rfid_calibrate() */
+#define SPI_CS_PN532 SPI_CS( PN532_CS_PORT, PN532_CS_PIN, 64, 5, SPI_CS_MODE_SKIP_TX|SPI_CS_MODE_BIT_REVERSED )
 
 #endif/*__CONFIG_H__*/
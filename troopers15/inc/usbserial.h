@@ -28,7 +28,17 @@
 extern void usb_init (void);
 extern void usb_flush (void);
 extern int usb_getchar (void);
+extern int usb_rx_pending (void);
 extern int usb_putchar (uint8_t data);
+/* block copies, return the number of bytes transferred - usb_write
+   waits for the host while USB is configured, but returns short once
+   the host fetched nothing for USB_WRITE_STALL_US */
+extern int usb_read (void *buf, int len);
+extern int usb_write (const void *buf, int len);
+/* zero-copy access to bulk IN FIFO storage */
+extern uint8_t *usb_tx_reserve (uint16_t offset, uint16_t * len);
+extern void usb_tx_commit (uint16_t len);
+extern void usb_printf (const char *fmt, ...);
 #endif /*ENABLE_USB_FULLFEATURED */
 
 #endif/*__USBSERIAL_H__*/
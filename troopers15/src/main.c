@@ -105,10 +105,7 @@ The Szenario 1 with pn53x Commands:
 #include "iap.h"
 #include "rfid.h"
 #include "usbserial.h"
-
-#define PN532_FIFO_SIZE 64
-#define PN532_MAX_PAYLAOADSIZE 264
-#define PN532_MAX_PACKET_SIZE (PN532_MAX_PAYLAOADSIZE+11)
+#include "libnfc.h"
 
 #define NOTHING 4
 #define EMULATE 0
@@ -139,307 +136,143 @@ static uint8_t payload[80];
 
 void check_profile_leds (void);
 
-typedef enum {
-	STATE_IDLE = 0,
-	STATE_PREFIX = -1,
-	STATE_PREFIX_EXT = -2,
-	STATE_HEADER = -3,
-	STATE_WAKEUP = -4,
-	STATE_FIFOFLUSH = -5,
-	STATE_PAYLOAD = -6,
-	STATE_FLOWCTRL = -7
-} PN532_State;
-
-typedef struct {
-	uint32_t last_seen;
-	uint16_t reserved;
-	uint16_t pos;
-	uint16_t expected;
-	uint8_t data_prev;
-	uint8_t wakeup;
-	uint8_t crc;
-	uint8_t tfi;
-	PN532_State state;
-	uint8_t data[PN532_MAX_PACKET_SIZE + 1];
-} PN532_Packet;
-
-static PN532_Packet buffer_put, buffer_get;
-
-static void packet_init(PN532_Packet * pkt, uint8_t reserved, uint8_t tfi)
-{
-	memset(pkt, 0, sizeof(*pkt));
-	pkt->reserved = reserved;
-	pkt->tfi = tfi;
-	pkt->data_prev = 0x01;
-}
-
-static void packet_reset(PN532_Packet * pkt)
-{
-	packet_init(pkt, pkt->reserved, pkt->tfi);
-}
+/* standalone START */
+#define MIFARE_KEY_SIZE 6
+const unsigned char mifare_key[MIFARE_KEY_SIZE] =
+    { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+unsigned char test_signal = 0;
 
-static int packet_put(PN532_Packet * pkt, uint8_t data)
+static void rfid_async_done(int res, void *data, void *context)
 {
-	PN532_State res;
-	uint8_t len, lcs;
-	const uint8_t prefix[] = { 0x00, 0x00, 0xFF };
-
-	res = pkt->state;
-
-	switch (pkt->state) {
-	case STATE_WAKEUP:
-		{
-			debug("\nWAKEUP\n");
-			pmu_wait_ms(50);
-			res = STATE_IDLE;
-			/* intentionally no 'break;' */
-		}
-
-	case STATE_IDLE:
-		{
-			/* TODO: WTF? - need to wait for one character */
-			debug_printf(".");
-
-			/* if needed, delete packet from previous run */
-			if (pkt->pos) {
-				packet_reset(pkt);
-				break;
-			}
-
-			/* scan for 0x00+0xFF prefix */
-			if (data == 0xFF && pkt->data_prev == 0x00) {
-				memcpy(&pkt->data[pkt->reserved], prefix,
-				       sizeof(prefix));
-				/* add size of reserved+prefix to packet pos */
-				pkt->pos = pkt->reserved + sizeof(prefix);
-				/* expect at least a short frame */
-				pkt->expected = pkt->pos + 2;
-				/* switch to prefix reception mode */
-				res = STATE_FLOWCTRL;
-				break;
-			}
-
-			/* scan for HSU wakeup */
-			if (data == 0x55 && pkt->data_prev == 0x55)
-				/* wait for three times 0x00 */
-				pkt->wakeup = 3;
-			else if (pkt->wakeup) {
-				if (data)
-					pkt->wakeup = 0;
-				else {
-					pkt->wakeup--;
-					if (!pkt->wakeup) {
-						res = STATE_WAKEUP;
-						break;
-					}
-				}
-			}
-
-			break;
-		}
+	(void)data;
 
-	case STATE_FLOWCTRL:
-		{
-			pkt->data[pkt->pos++] = data;
-			if (pkt->pos >= pkt->expected) {
-				lcs = pkt->data[pkt->pos - 1];
-				len = pkt->data[pkt->pos - 2];
-
-				/* detected extended frame */
-				if (len == 0xFF && lcs == 0xFF) {
-					debug("IR: extended frame\n");
-					/* expect three more bytes for extended frame */
-					pkt->expected += 4;
-					res = STATE_PREFIX_EXT;
-					break;
-				}
-
-				/* detected ACK frame */
-				if (len == 0xFF && lcs == 0x00) {
-					res = pkt->pos;
-					break;
-				}
-
-				/* detected NACK frame */
-				if (len == 0x00 && lcs == 0xFF) {
-					res = pkt->pos;
-					break;
-				}
+	*((int *)context) = res;
+}
 
-				pkt->expected++;
-				res = STATE_PREFIX;
-			}
+static unsigned char mifare_block[24];
+static int mifare_block_res;
 
-			break;
-		}
+/* queue MIFARE Read only once the card accepted the key - a read on
+   an unauthenticated card would wait out PN532_TIMEOUT_US */
+static void mifare_auth_done(int res, void *data, void *context)
+{
+	unsigned char *p = data;
+	int err;
 
-	case STATE_PREFIX:
-		{
-			pkt->data[pkt->pos++] = data;
-			if (pkt->pos >= pkt->expected) {
-				lcs = pkt->data[pkt->pos - 2];
-				len = pkt->data[pkt->pos - 3];
-
-				if (len == 0x01 && lcs == 0xFF) {
-					pkt->expected += len;
-					pkt->crc = pkt->data[pkt->pos - 1];
-					res = STATE_PAYLOAD;
-					break;
-				}
+	rfid_async_done(res, data, context);
+	if (res < 2 || p[0] != 0x41 || p[1] != 0x00)
+		return;
 
-				/* if valid short packet */
-				if (((uint8_t) (len + lcs)) == 0) {
-					pkt->expected += len;
-
-					/*detect oversized packets */
-					if (pkt->expected >
-					    PN532_MAX_PACKET_SIZE) {
-						packet_reset(pkt);
-						res = STATE_IDLE;
-					} else {
-						/* check for TFI */
-						if (pkt->data[pkt->pos - 1] ==
-						    pkt->tfi) {
-							/* maintain CRC including TFI */
-							pkt->crc = pkt->tfi;
-							res = STATE_PAYLOAD;
-						} else {
-							packet_reset(pkt);
-							res = STATE_IDLE;
-						}
-					}
+	if ((err = rfid_submit(mifare_block, 4, sizeof(mifare_block),
+			       PN532_TIMEOUT_US, rfid_async_done,
+			       &mifare_block_res)) < 0)
+		mifare_block_res = err;
+}
 
-					break;
-				}
-			}
-			break;
-		}
+/* wait for queued PN532 commands while servicing buttons and LEDs */
+static int rfid_wait_bg(short menu)
+{
+	while (rfid_poll() > 0) {
+		check_profile_leds();
 
-	case STATE_PREFIX_EXT:
-		{
-			/* TODO: add extended frame support */
-			debug("IR: extended frame is not yet supported\n");
-			packet_reset(pkt);
-			res = STATE_IDLE;
-			break;
+		/* menu changed - abort pending PN532 commands */
+		if (main_menu != menu) {
+			rfid_abort();
+			return -8;
 		}
 
-	case STATE_PAYLOAD:
-		{
-			pkt->data[pkt->pos++] = data;
-			pkt->crc += data;
-
-			if (pkt->pos >= pkt->expected) {
-				if (pkt->crc) {
-					debug("IR: packet CRC error [0x%02X]\n",
-					      pkt->crc);
-					packet_reset(pkt);
-					res = STATE_IDLE;
-				} else
-					res = pkt->pos;
-			}
-			break;
-		}
+		/* '?' on CDC dumps PN532 statistics and latency histograms */
+		if (usb_getchar() == '?')
+			rfid_status(usb_printf);
 
-	default:
-		{
-			debug("IR: unknown state!!!\n");
-			packet_reset(pkt);
-			res = STATE_IDLE;
-		}
+		rfid_idle();
 	}
 
-	pkt->data_prev = data;
-	pkt->state = (res > 0) ? STATE_IDLE : res;
-
-	return res;
+	return 0;
 }
 
-void dump_packet(uint8_t * data, int count)
+/* run PN532 command in background while servicing buttons and LEDs */
+static int rfid_execute_bg(void *data, unsigned int isize,
+			   unsigned int osize, short menu)
 {
-	int i;
-	for (i = 0; i < count; i++)
-		debug_printf("%c%02X", 6 == i % 7 ? '*' : ' ', *data++);
-	debug_printf("\n");
-}
+	int res, err;
 
-/* standalone START */
-#define MIFARE_KEY_SIZE 6
-const unsigned char mifare_key[MIFARE_KEY_SIZE] =
-    { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-unsigned char test_signal = 0;
+	if ((err = rfid_submit(data, isize, osize, PN532_TIMEOUT_US,
+			       rfid_async_done, &res)) < 0)
+		return err;
 
-static void rfid_hexdump(const void *buffer, int size)
-{
-	int i;
-	const unsigned char *p = (unsigned char *)buffer;
+	if ((err = rfid_wait_bg(menu)) < 0)
+		return err;
 
-	for (i = 0; i < size; i++) {
-		if (i && ((i & 3) == 0))
-			debug_printf(" ");
-		debug_printf(" %02X", *p++);
-	}
-	debug_printf(" [size=%02i]\n", size);
+	return res;
 }
 
-/* get firmware version */
-static void get_firmware_version(void)
+/* same for pre-encoded constant frames, response goes to data */
+static int rfid_execute_frame_bg(const void *frame, unsigned int size,
+				 void *data, unsigned int osize, short menu)
 {
-	int i;
-	uint8_t data;
-	data = PN532_CMD_GetFirmwareVersion;
+	int res, err;
 
-	while (1) {
-		if (((i = rfid_write(&data, sizeof(data))) == 0) &&
-		    ((i = rfid_read(buffer_get.data, PN532_FIFO_SIZE))) > 0)
-			break;
+	if ((err = rfid_submit_frame(frame, size, data, osize,
+				     PN532_TIMEOUT_US, rfid_async_done,
+				     &res)) < 0)
+		return err;
 
-		debug_printf("fw_res=%i\n", i);
-		pmu_wait_ms(490);
-		GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
-		pmu_wait_ms(10);
-		GPIOSetValue(LED_PORT, LED_BIT, LED_OFF);
-	}
+	if ((err = rfid_wait_bg(menu)) < 0)
+		return err;
 
-	if (buffer_get.data[1] == 0x32)
-		debug_printf("PN532 firmware version: v%i.%i\n",
-			     buffer_get.data[2], buffer_get.data[3]);
-	else
-		debug("Unknown firmware version\n");
+	return res;
 }
 
+/* time between two card polls - after READ_IDLE_POLLS empty polls
+   in a row only every READ_IDLE_WINDOWS-th poll window is used */
+#define READ_POLL_INTERVAL_US 500000UL
+#define READ_IDLE_POLLS 20
+#define READ_IDLE_WINDOWS 4
+
 static void loop_read_rfid(void)
 {
-	int res, old_test_signal = -1;
+	int res, err, idle, window, old_test_signal = -1;
 	static unsigned char data[80], ultralightid[16], bus, signal;
 	static unsigned char oid[4];
+	/* enable test signal output on U.FL sockets, select test bus
+	   signal and type - sent as a single WriteRegister frame */
+	static TRfidRegister test_regs[] = {
+		{0x6328, 0xFC},
+		{0x6321, 0x00},
+		{0x6322, 0x00},
+	};
 
 	/* fully initialized */
 	GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
 
 	debug_printf("in read\n");
 
-	/* User Manual S.97 141520.pdf */
-	data[0] = PN532_CMD_SAMConfiguration;
-	data[1] = 0x01;		/* Normal Mode */
-	res = rfid_execute(&data, 2, sizeof(data));
+	/* User Manual S.97 141520.pdf - SAMConfiguration Normal Mode */
+	res = rfid_execute_frame(rfid_frame_sam_configuration,
+				 sizeof(rfid_frame_sam_configuration),
+				 &data, sizeof(data));
+
+	/* empty polls return within a few milliseconds */
+	rfid_set_profile(RFID_PROFILE_FAST_POLL);
 
 	/* show card response on U.FL */
 	test_signal = (25 << 3) | 2;
 	/* enable debug output */
 	GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
 
+	idle = 0;
 	while (1) {
 		if (main_menu != READ) {
 			break;
 		}
         check_profile_leds ();
-		/* detect cards in field */
-		data[0] = PN532_CMD_InListPassiveTarget; /* 0x4a */
-		data[1] = 0x01;	/* MaxTg - maximum cards */
-		data[2] = 0x00;	/* BrTy - 106 kbps type A */
-
-		if (((res = rfid_execute(&data, 3, sizeof(data))) >= 11)
+		/* detect cards in field - InListPassiveTarget, one card,
+		   106 kbps type A */
+		if (((res = rfid_execute_frame_bg(
+			      rfid_frame_in_list_passive_target,
+			      sizeof(rfid_frame_in_list_passive_target),
+			      &data, sizeof(data), READ)) >= 11)
 		    && (data[1] == 0x01) && (data[2] == 0x01)) {
 			/* only for Mifare Ultralight cards */
 			if (data[3] == 0 && data[4] == 0x44) {
@@ -488,7 +321,6 @@ static void loop_read_rfid(void)
 			if (data[3] == 0 && data[4] == 4 && data[6] >= 4) {
 				memcpy(oid, &data[7], sizeof(oid));
 
-				res = 0;
 				data[0] = PN532_CMD_InDataExchange; /* 0x40 */
 				data[1] = 0x01;	/* card 1 */
 				data[2] = 0x60;	/* MIFARE authenticate A */
@@ -498,34 +330,28 @@ static void loop_read_rfid(void)
 				/* MIFARE default key 6*0xFF */
 				memcpy(&data[4], mifare_key, MIFARE_KEY_SIZE);
 
-				if (res <= 0) {
-					/* MIFARE Authenticate */
-					if (main_menu != READ) {
-						break;
-					}
-					res =
-					    rfid_execute(&data, 14,
-							 sizeof(data));
+				mifare_block[0] = PN532_CMD_InDataExchange; /* 0x40 */
+				mifare_block[1] = 0x01;	/* card 1 */
+				mifare_block[2] = 0x30;	/* MIFARE read 16 bytes */
+				mifare_block[3] = 0x01;	/* block 1 */
+				mifare_block_res = -1;
+
+				/* MIFARE Authenticate, Read chained on success */
+				res = -1;
+				if ((err = rfid_submit(&data, 14, sizeof(data),
+						       PN532_TIMEOUT_US,
+						       mifare_auth_done, &res)) < 0)
+					res = err;
+				else if (rfid_wait_bg(READ) < 0) {
+					break;
 				}
 
-				if (res > 0) {
-					res = 0;
+				if (res >= 2 && data[0] == 0x41 && data[1] == 0x00) {
 					rfid_hexdump(&data, res);
 
-					data[0] = PN532_CMD_InDataExchange; /* 0x40 */
-					data[1] = 0x01;	/* card 1 */
-					data[2] = 0x30;	/* MIFARE read 16 bytes */
-					data[3] = 0x01;	/* block 1 */
-
 					/* MIFARE Read */
-					if (res <= 0) {
-						if (main_menu != READ) {
-							break;
-						}
-						res =
-						    rfid_execute(&data, 14,
-								 sizeof(data));
-					}
+					res = mifare_block_res;
+					memcpy(data, mifare_block, sizeof(mifare_block));
 
 					debug_printf("\nMIFARE_READ:");
 					if (res == 18) {
@@ -570,20 +396,32 @@ static void loop_read_rfid(void)
 			GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
 			pmu_wait_ms(50);
 			GPIOSetValue(LED_PORT, LED_BIT, LED_OFF);
+			idle = 0;
 		} else {
 			GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
 			if (res != -8)
 				debug_printf("PN532 error res=%i\n", res);
+			if (idle < READ_IDLE_POLLS)
+				idle++;
 		}
 
-		/* wait 0.5s */
-		pmu_wait_ms(500);
-
-		/* turning field off */
-		data[0] = PN532_CMD_RFConfiguration;
-		data[1] = 0x01;	/* CfgItem = 0x01 */
-		data[2] = 0x00;	/* RF Field = off */
-		rfid_execute(&data, 3, sizeof(data));
+		/* power down PN532 till next poll - an external RF field wakes
+		   it early, passive cards are only found by polling. Without
+		   cards around for a while, skip poll windows */
+		for (window = 0; window < ((idle < READ_IDLE_POLLS) ? 1 :
+					   READ_IDLE_WINDOWS); window++) {
+			if ((res = rfid_sleep(READ_POLL_INTERVAL_US)) < 0) {
+				rfid_execute_frame(rfid_frame_rf_field_off,
+						   sizeof(rfid_frame_rf_field_off),
+						   &data, sizeof(data));
+				pmu_wait_ms(READ_POLL_INTERVAL_US / 1000);
+			}
+			/* RF activity or menu change - poll right away */
+			if (res > 0 || main_menu != READ) {
+				idle = 0;
+				break;
+			}
+		}
 
 		if (test_signal != old_test_signal) {
 			old_test_signal = test_signal;
@@ -592,11 +430,11 @@ static void loop_read_rfid(void)
 			signal = test_signal & 0x7;
 			bus = (test_signal >> 3) & 0x1F;
 
-			rfid_write_register(0x6328, 0xFC);
-			/* select test bus signal */
-			rfid_write_register(0x6321, signal);
-			/* select test bus type */
-			rfid_write_register(0x6322, bus);
+			test_regs[1].data = signal;
+			test_regs[2].data = bus;
+			rfid_write_registers(test_regs,
+					     sizeof(test_regs) /
+					     sizeof(test_regs[0]));
 			/* debug_printf("UPDATED_DEBUG_OUTPUT\n"); */
 		}
 		/* display current test signal ID */
@@ -606,98 +444,11 @@ static void loop_read_rfid(void)
 /* standalone END */
 
 /* libnfc START */
-static void loop_libnfc_rfid(void)
+static BOOL libnfc_running(void)
 {
-	int t, count, res;
-	uint8_t data, *p;
+	check_profile_leds();
 
-	debug_printf("in libnfc\n");
-
-	packet_init(&buffer_get, 0, 0xD5);
-	packet_init(&buffer_put, 1, 0xD4);
-
-	/* run RFID loop */
-	t = 0;
-	while (1) {
-		if (main_menu != LIBNFC) {
-			break;
-		}
-        check_profile_leds ();
-
-		if (!GPIOGetValue(PN532_IRQ_PORT, PN532_IRQ_PIN)) {
-			GPIOSetValue(LED_PORT, LED_BIT, (t++) & 1);
-
-			data = 0x03;
-
-			spi_txrx(SPI_CS_PN532 | SPI_CS_MODE_SKIP_CS_DEASSERT,
-				 &data, sizeof(data), NULL, 0);
-
-			while (!GPIOGetValue(PN532_IRQ_PORT, PN532_IRQ_PIN)) {
-			    check_profile_leds();
-				spi_txrx((SPI_CS_PN532 ^ SPI_CS_MODE_SKIP_TX) |
-					 SPI_CS_MODE_SKIP_CS_ASSERT |
-					 SPI_CS_MODE_SKIP_CS_DEASSERT, NULL, 0,
-					 &data, sizeof(data));
-
-				if ((res = packet_put(&buffer_get, data)) > 0) {
-					/* add termination */
-					buffer_get.data[res++] = 0x00;
-					p = buffer_get.data;
-					count = res;
-					while (count--) {
-			            check_profile_leds();
-						usb_putchar(*p++);
-					}
-					usb_flush();
-#ifdef  DEBUG
-					debug("RX: ");
-					dump_packet(buffer_get.data, res);
-#endif
-				}
-			}
-
-			spi_txrx(SPI_CS_PN532 | SPI_CS_MODE_SKIP_CS_ASSERT,
-				 NULL, 0, NULL, 0);
-		}
-
-		while ((res = usb_getchar()) >= 0) {
-            check_profile_leds();
-			if ((count =
-			     packet_put(&buffer_put, (uint8_t) res)) > 0) {
-				GPIOSetValue(LED_PORT, LED_BIT, (t++) & 1);
-				buffer_put.data[0] = 0x01;
-				buffer_put.data[count++] = 0x00;
-				spi_txrx(SPI_CS_PN532, buffer_put.data, count,
-					 NULL, 0);
-#ifdef  DEBUG
-				debug("TX: ");
-				dump_packet(&buffer_put.data[1], count - 1);
-#endif				 /*DEBUG*/
-				    break;
-			} else {
-				switch (count) {
-				case STATE_WAKEUP:
-					/* reset PN532 */
-					GPIOSetValue(PN532_RESET_PORT,
-						     PN532_RESET_PIN, 0);
-					pmu_wait_ms(100);
-					GPIOSetValue(PN532_RESET_PORT,
-						     PN532_RESET_PIN, 1);
-					pmu_wait_ms(400);
-					count = 0;
-					break;
-				case STATE_FIFOFLUSH:
-					/* flush PN532 buffers */
-					buffer_put.data[0] = 0x01;
-					memset(&buffer_put.data[1], 0,
-					       PN532_FIFO_SIZE);
-					spi_txrx(SPI_CS_PN532, buffer_put.data,
-						 PN532_FIFO_SIZE + 1, NULL, 0);
-					break;
-				}
-			}
-		}
-	}
+	return main_menu == LIBNFC;
 }
 /* libnfc END */
 
@@ -720,31 +471,48 @@ static void loop_libnfc_rfid(void)
 #define MF_SAK_CLASSIC_1K 0x08
 #define MF_SAK_CLASSIC_4K 0x18
 #define SAK_ISO_14443_4_COMPLIANT 0x20
+
+/* link errors tolerated in target_init() before giving up */
+#define TARGET_INIT_ERRORS 3
+
+/* TgInitAsTarget, encoded at build time */
+static const unsigned char tg_init_as_target[RFID_FRAME_SIZE(38)] =
+	RFID_FRAME(38,
+		   PN532_CMD_TgInitAsTarget,	/* 0x8C */
+		   MODE_PASSIVE | MODE_PICC,
+		   /* 6 Bytes Mifare */
+		   MF_MINI_1,	/* SENS_RES */
+		   MF_MINI_2,
+		   /*prefix= 0x08 */
+		   0xDE,	/* three Bytes UID (NFCID1); first Byte is prefixed by the pn532-chip (0x08) */
+		   0xC0,
+		   0xDE,
+		   SAK_ISO_14443_4_COMPLIANT	/* SEL_RES */
+		   /* 18 Bytes FeliC + 10 Bytes NFCID3t + 1 Byte Len(GT) +
+		      1 Byte Len(TK) are zero */
+	);
+
 static int target_init(unsigned char* data, unsigned int size) {
-    int res = -1;
+    int res = -1, errors = 0;
     while(res < 0) {
         check_profile_leds();
-        data[0] = PN532_CMD_TgInitAsTarget;	/* 0x8C */
-        data[1] = MODE_PASSIVE | MODE_PICC;
-        /* 6 Bytes Mifare */
-        data[2] = MF_MINI_1;	/* SENS_RES */
-        data[3] = MF_MINI_2;
-        /*prefix= 0x08 */
-        data[4] = 0xDE;	/* three Bytes UID (NFCID1); first Byte is prefixed by the pn532-chip (0x08) */
-        data[5] = 0xC0;
-        data[6] = 0xDE;
-        data[7] = SAK_ISO_14443_4_COMPLIANT; //MF_SAK_MINI;	/* SEL_RES */
-
-        /* 18 Bytes FeliC + 10 Bytes NFCID3t + 1 Byte Len(GT) + 1 Byte Len(TK) */
-        for (unsigned int i = 8; i < size; i++) {
-            data[i] = 0x00;
-        }
 
-        res = rfid_execute(data, 38, size);
+        res = rfid_execute_frame_bg(tg_init_as_target,
+                                    sizeof(tg_init_as_target),
+                                    data, size, EMULATE);
 
 	if (main_menu != EMULATE) {
             return -2;
         }
+
+        /* timeout just means no reader in range - anything else is a
+           link error, reset PN532 but don't retry forever */
+        if (res < 0 && res != -8) {
+            if (++errors > TARGET_INIT_ERRORS) {
+                return res;
+            }
+            rfid_recover();
+        }
     }
     /* data: 0x8D + 1 Byte Mode + n Byte Initator CMD */
     return res;
@@ -807,10 +575,13 @@ static void loop_emulate_rfid(void)
 
 	debug_printf("in emulate\n");
 
-	/* User Manual S.97 141520.pdf */
-	data[0] = PN532_CMD_SAMConfiguration;	/* 0x14 */
-	data[1] = 0x01;		/* Normal Mode */
-	res = rfid_execute(&data, 2, sizeof(data));
+	/* User Manual S.97 141520.pdf - SAMConfiguration Normal Mode */
+	res = rfid_execute_frame(rfid_frame_sam_configuration,
+				 sizeof(rfid_frame_sam_configuration),
+				 &data, sizeof(data));
+
+	/* PN532 defaults for target mode */
+	rfid_set_profile(RFID_PROFILE_EMULATION);
 
 	GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
 
@@ -844,7 +615,7 @@ static void loop_emulate_rfid(void)
 
             if(res >= 0) {
                 data[0] = PN532_CMD_TgGetData; /* 0x86 */
-                res = rfid_execute(&data, 1, sizeof(data));
+                res = rfid_execute_bg(&data, 1, sizeof(data), EMULATE);
 
                 pmu_wait_ms(5);
 
@@ -1102,10 +873,6 @@ int main(void)
 	GPIOSetValue(LED_PORT, LED_BIT, LED_ON);
 	pmu_wait_ms(500);
 
-	/* reset FIFO buffers */
-	packet_init(&buffer_get, 0, 0xD5);
-	packet_init(&buffer_put, 1, 0xD4);
-
     /* UID */
     TDeviceUID uid;
     debug_printf ("UID:");
@@ -1117,6 +884,14 @@ int main(void)
 
 	get_firmware_version();
 
+	/* pick the fastest PN532 SPI clock that survives an echo test */
+	rfid_calibrate();
+
+#ifdef  PN532_BENCHMARK
+	/* compare IRQ line and SPI status polling on this board */
+	rfid_benchmark(debug_printf, 100);
+#endif /*PN532_BENCHMARK */
+
 	debug_printf ("You have passed the Test\n");
 	debug_printf ("What Test?\n");
 	debug_printf ("... the Debuginterfacetest\n");
@@ -1167,7 +942,7 @@ int main(void)
                 break;
             case LIBNFC:
                 libnfc_leds();
-                loop_libnfc_rfid();
+                loop_libnfc_rfid(libnfc_running);
                 break;
             case NOTHING:
                 pmu_wait_ms(500);